@@ -0,0 +1,675 @@
+// Benchmark of the index and search engine on a synthetic buddy list,
+// built against the engine library alone so neither Pidgin nor an X
+// display is needed.
+//
+//   make bench && ./quickpurple-bench --contacts 50000 --unicode 0.3
+//
+// With --check it times single letter searches instead, which match most
+// of the buddy list, and fails if one is slower than allowed; make check
+// runs it on 100000 contacts.
+
+#include "../quickindex.h"
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+static gint num_contacts = 10000;
+static gint num_accounts = 3;
+static gint alias_words = 2;
+static gdouble unicode_share = 0.2;
+static gint num_queries = 1000;
+static gint seed = 1;
+static gboolean substrings = FALSE;
+static gint num_threads = 1;
+static gboolean verbose = FALSE;
+static gint check_ms = 0;
+
+static GOptionEntry options[] =
+{
+  { "contacts", 'n', 0, G_OPTION_ARG_INT, &num_contacts,
+    "Number of contacts in the buddy list", "N" },
+  { "accounts", 'a', 0, G_OPTION_ARG_INT, &num_accounts,
+    "Number of accounts the buddies belong to", "N" },
+  { "alias-words", 'w', 0, G_OPTION_ARG_INT, &alias_words,
+    "Words in the longest aliases", "N" },
+  { "unicode", 'u', 0, G_OPTION_ARG_DOUBLE, &unicode_share,
+    "Share of aliases written in other scripts than latin", "RATIO" },
+  { "queries", 'q', 0, G_OPTION_ARG_INT, &num_queries,
+    "Number of queries typed", "N" },
+  { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Random seed", "N" },
+  { "substrings", 'S', 0, G_OPTION_ARG_NONE, &substrings,
+    "Index trigrams to find text inside words", NULL },
+  { "threads", 't', 0, G_OPTION_ARG_INT, &num_threads,
+    "Score queries with up to N threads, timing every power of two", "N" },
+  { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+    "Print the queries and their best results", NULL },
+  { "check", 'c', 0, G_OPTION_ARG_INT, &check_ms,
+    "Only check that single letter searches take at most MS and report "
+    "every item once", "MS" },
+  { NULL }
+};
+
+// synthetic buddy list
+
+// Aliases are made of words built from syllables of a script, the first
+// word is drawn from a small pool with a skewed distribution so some names
+// are shared by many contacts as in real buddy lists. Every account adds
+// its statuses as the plugin does.
+
+#define COMMON_WORDS 64
+
+enum script
+{
+  LATIN,
+  ACCENTED,
+  CYRILLIC,
+  GREEK,
+  HAN,
+  NUM_SCRIPTS
+};
+
+typedef struct _contact
+{
+  gchar* alias;
+  gchar* name;
+  guint account;
+} contact;
+
+static const gchar* latin_syllables[] =
+{
+  "al", "ex", "an", "dre", "jo", "hn", "ma", "ri", "son", "ber", "ta", "vi",
+  "el", "na", "mar", "tin", "ste", "ve", "ka", "lo", "mi", "chel", "ro", "ger",
+  "sa", "ra", "ni", "co", "le", "da", "vid", "ton"
+};
+
+static const gchar* accented_syllables[] =
+{
+  "zé", "ño", "mü", "ła", "ør", "çe", "jö", "ré", "ná", "šk", "ğa", "ïs",
+  "an", "to", "ma", "ri", "el", "va"
+};
+
+static const gchar* cyrillic_syllables[] =
+{
+  "ка", "ло", "ми", "ан", "дре", "ва", "ни", "ков", "ев", "ол", "ег", "са",
+  "ша", "ин", "ра", "то", "ля", "ед", "юр", "ий"
+};
+
+static const gchar* greek_syllables[] =
+{
+  "κα", "λο", "μη", "αν", "δρε", "νι", "κος", "γι", "ωρ", "γος", "ελ", "ένη",
+  "πα", "σο", "θε", "ός"
+};
+
+static const gchar* han_syllables[] =
+{
+  "王", "李", "张", "刘", "陈", "杨", "黄", "赵", "明", "华", "伟", "芳", "军",
+  "丽", "强", "磊", "洋", "艳", "勇", "杰"
+};
+
+static const gchar** syllables[NUM_SCRIPTS] =
+{
+  latin_syllables, accented_syllables, cyrillic_syllables, greek_syllables,
+  han_syllables
+};
+
+static const guint num_syllables[NUM_SCRIPTS] =
+{
+  G_N_ELEMENTS(latin_syllables), G_N_ELEMENTS(accented_syllables),
+  G_N_ELEMENTS(cyrillic_syllables), G_N_ELEMENTS(greek_syllables),
+  G_N_ELEMENTS(han_syllables)
+};
+
+static const gchar* protocols[] = { "XMPP", "ICQ", "IRC", "GroupWise" };
+
+static const gchar* statuses[] =
+{
+  "Available", "Away", "Do not disturb", "Extended away", "Invisible",
+  "Offline"
+};
+
+static GRand* rand_gen = NULL;
+static contact* roster = NULL;
+static gchar* common_words[NUM_SCRIPTS][COMMON_WORDS];
+
+static gchar* make_word(enum script script)
+{
+  GString* word = g_string_new(NULL);
+  gint n = g_rand_int_range(rand_gen, script == HAN ? 1 : 2, 4);
+  while (n--)
+    g_string_append(word,
+        syllables[script][g_rand_int_range(rand_gen, 0, num_syllables[script])]);
+  if (script != HAN)
+  {
+    // capitalized, the index has to casefold it
+    gchar* rest = g_utf8_next_char(word->str);
+    gchar* first = g_utf8_strup(word->str, rest - word->str);
+    g_string_erase(word, 0, rest - word->str);
+    g_string_prepend(word, first);
+    g_free(first);
+  }
+  return g_string_free(word, FALSE);
+}
+
+static enum script pick_script()
+{
+  if (g_rand_double(rand_gen) >= unicode_share)
+    return LATIN;
+  return (enum script)g_rand_int_range(rand_gen, LATIN + 1, NUM_SCRIPTS);
+}
+
+static gchar* make_alias()
+{
+  enum script script = pick_script();
+  gdouble r = g_rand_double(rand_gen);
+  GString* alias = g_string_new(
+      common_words[script][(guint)(r * r * COMMON_WORDS)]);
+  gint n = g_rand_int_range(rand_gen, 0, MAX(alias_words, 1));
+  while (n--)
+  {
+    gchar* word = make_word(script);
+    g_string_append_c(alias, ' ');
+    g_string_append(alias, word);
+    g_free(word);
+  }
+  return g_string_free(alias, FALSE);
+}
+
+static void create_roster()
+{
+  gint i, s;
+  for (s = 0; s < NUM_SCRIPTS; ++s)
+    for (i = 0; i < COMMON_WORDS; ++i)
+      common_words[s][i] = make_word((enum script)s);
+  roster = g_new0(contact, num_contacts);
+  for (i = 0; i < num_contacts; ++i)
+  {
+    roster[i].alias = make_alias();
+    roster[i].name = g_strdup_printf("buddy%d@example.com", i);
+    roster[i].account = g_rand_int_range(rand_gen, 0, num_accounts);
+  }
+}
+
+static void destroy_roster()
+{
+  gint i, s;
+  for (i = 0; i < num_contacts; ++i)
+  {
+    g_free(roster[i].alias);
+    g_free(roster[i].name);
+  }
+  g_free(roster);
+  for (s = 0; s < NUM_SCRIPTS; ++s)
+    for (i = 0; i < COMMON_WORDS; ++i)
+      g_free(common_words[s][i]);
+}
+
+// Contacts are added first so their ids are their positions in the
+// roster, the account statuses follow.
+static gchar* get_identity(guint id, gpointer data)
+{
+  if (id < num_contacts)
+    return g_strdup_printf("contact\t%u\t%s", roster[id].account,
+        roster[id].name);
+  return g_strdup_printf("status\t%u", id - num_contacts);
+}
+
+static void add_roster(quick_index* index)
+{
+  gint i, s;
+  for (i = 0; i < num_contacts; ++i)
+    quick_index_add(index, roster[i].alias);
+  for (i = 0; i < num_accounts; ++i)
+    for (s = 0; s < G_N_ELEMENTS(statuses); ++s)
+    {
+      gchar* text = g_strdup_printf("bench%d@example.org %s %s", i,
+          protocols[i % G_N_ELEMENTS(protocols)], statuses[s]);
+      quick_index_add(index, text);
+      g_free(text);
+    }
+}
+
+// A latin and a cyrillic layout on the same keys, lower case on level 0
+// and upper case on level 1.
+
+#define FIRST_KEYCODE 24
+
+static const gchar* layouts[] =
+{
+  "qwertyuiop[]asdfghjkl;'zxcvbnm,.",
+  "йцукенгшщзхъфывапролджэячсмитьбю"
+};
+
+static quick_layouts* make_layouts()
+{
+  quick_layouts* result = quick_layouts_new();
+  guint group;
+  for (group = 0; group < G_N_ELEMENTS(layouts); ++group)
+  {
+    const gchar* p = layouts[group];
+    guint keycode;
+    for (keycode = FIRST_KEYCODE; *p; p = g_utf8_next_char(p), ++keycode)
+    {
+      gunichar c = g_utf8_get_char(p);
+      quick_layouts_add_key(result, group, keycode, 0, c);
+      quick_layouts_add_key(result, group, keycode, 1, g_unichar_toupper(c));
+    }
+  }
+  return result;
+}
+
+// measurements
+
+typedef struct _latencies
+{
+  const char* name;
+  GArray* samples;
+} latencies;
+
+static glong peak_rss()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static gint compare_sample(gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(gint64*)a;
+  gint64 y = *(gint64*)b;
+  return x < y ? -1 : x > y;
+}
+
+static gdouble percentile(GArray* samples, gdouble p)
+{
+  guint i = (guint)(p * (samples->len - 1) + 0.5);
+  return g_array_index(samples, gint64, i) / 1000.0;
+}
+
+static void report_latencies(latencies* l)
+{
+  if (!l->samples->len)
+    return;
+  g_array_sort(l->samples, compare_sample);
+  printf("  %-10s %7u %8.3f %8.3f %8.3f %8.3f\n", l->name, l->samples->len,
+      percentile(l->samples, 0.5), percentile(l->samples, 0.9),
+      percentile(l->samples, 0.99), percentile(l->samples, 1));
+}
+
+static void print_stats(quick_index* index)
+{
+  quick_index_stats stats;
+  quick_index_get_stats(index, &stats);
+  printf("index of %u items in %u KiB: %u words %u KiB, %u postings %u KiB, "
+      "%u trigrams %u KiB, strings %u KiB, items %u KiB, texts %u KiB, "
+      "masks %u KiB\n", stats.items, (guint)((stats.words_size
+          + stats.postings_size + stats.grams_size + stats.strings_size
+          + stats.items_size + stats.texts_size + stats.masks_size) / 1024),
+      stats.words, (guint)(stats.words_size / 1024),
+      stats.postings, (guint)(stats.postings_size / 1024),
+      stats.grams, (guint)(stats.grams_size / 1024),
+      (guint)(stats.strings_size / 1024), (guint)(stats.items_size / 1024),
+      (guint)(stats.texts_size / 1024), (guint)(stats.masks_size / 1024));
+}
+
+// Adds the buddy list to a new index, loading the snapshot if given, and
+// runs the main loop until its words are built.
+static quick_index* time_index(const char* what, GString* snapshot)
+{
+  static const quick_index_funcs funcs = { NULL, get_identity, NULL, NULL };
+  gint64 start = g_get_monotonic_time();
+  gint64 added;
+  quick_index* index = quick_index_new(&funcs, NULL);
+  quick_index_set_layouts(index, make_layouts());
+  quick_index_set_substrings(index, substrings);
+  add_roster(index);
+  if (snapshot)
+    quick_index_load(index, snapshot->str, snapshot->len);
+  quick_index_build(index);
+  added = g_get_monotonic_time();
+  while (quick_index_building(index))
+    g_main_context_iteration(NULL, TRUE);
+  printf("%-16s %8.1f ms, %.1f ms on the main thread\n", what,
+      (g_get_monotonic_time() - start) / 1000.0, (added - start) / 1000.0);
+  return index;
+}
+
+// Types the query a character at a time as the window does, every
+// keystroke searching the text typed so far. Fetching the texts of the
+// first page stands in for populate_tree, the tree view needs a display.
+static void type_query(quick_index* index, const gchar* query, guint group,
+    latencies* search, latencies* render)
+{
+  const gchar* end = query;
+  while (*end)
+  {
+    gchar* typed;
+    GArray* ids;
+    gint64 start, searched, rendered;
+    guint layout, i;
+    end = g_utf8_next_char(end);
+    typed = g_strndup(query, end - query);
+    start = g_get_monotonic_time();
+    ids = quick_index_query(index, typed, group, QUICK_INDEX_PAGE, &layout,
+        NULL);
+    searched = g_get_monotonic_time();
+    for (i = 0; i < ids->len; ++i)
+      g_free(g_strdup(quick_index_get_text(index,
+              g_array_index(ids, guint, i))));
+    rendered = g_get_monotonic_time() - searched;
+    searched -= start;
+    g_array_append_val(search->samples, searched);
+    g_array_append_val(render->samples, rendered);
+    if (verbose && !*end)
+    {
+      printf("%-24s %5u", typed, ids->len);
+      for (i = 0; i < ids->len && i < 3; ++i)
+        printf(" | %s", quick_index_get_text(index, g_array_index(ids, guint, i)));
+      printf("\n");
+    }
+    g_array_free(ids, TRUE);
+    g_free(typed);
+  }
+}
+
+// a prefix of a random word of the alias
+static gchar* prefix_query(const gchar* alias)
+{
+  gchar** words = g_strsplit(alias, " ", 0);
+  const gchar* word = words[g_rand_int_range(rand_gen, 0, g_strv_length(words))];
+  glong len = g_utf8_strlen(word, -1);
+  glong n = g_rand_int_range(rand_gen, 1, MIN(len, 6) + 1);
+  gchar* query = g_utf8_substring(word, 0, n);
+  g_strfreev(words);
+  return query;
+}
+
+// prefixes of two words of the alias, as typed to tell apart people
+// sharing a first name
+static gchar* words_query(const gchar* alias)
+{
+  gchar** words = g_strsplit(alias, " ", 0);
+  guint n = g_strv_length(words);
+  gchar* query = NULL;
+  if (n > 1)
+  {
+    guint first = g_rand_int_range(rand_gen, 0, n - 1);
+    guint second = g_rand_int_range(rand_gen, first + 1, n);
+    gchar* a = prefix_query(words[first]);
+    gchar* b = prefix_query(words[second]);
+    query = g_strconcat(a, " ", b, NULL);
+    g_free(a);
+    g_free(b);
+  }
+  g_strfreev(words);
+  return query;
+}
+
+// a few characters from inside the alias
+static gchar* infix_query(const gchar* alias)
+{
+  glong len = g_utf8_strlen(alias, -1);
+  glong start, n;
+  if (len < 4)
+    return NULL;
+  start = g_rand_int_range(rand_gen, 1, len - 2);
+  n = g_rand_int_range(rand_gen, 3, MIN(len - start, 6) + 1);
+  return g_utf8_substring(alias, start, start + n);
+}
+
+// a few characters of the alias in order, as typed when fuzzy matching
+static gchar* fuzzy_query(const gchar* alias)
+{
+  GString* query = g_string_new(NULL);
+  glong len = g_utf8_strlen(alias, -1);
+  glong i = 0;
+  gint n = g_rand_int_range(rand_gen, 3, 6);
+  while (n-- && i < len)
+  {
+    gunichar c;
+    i = g_rand_int_range(rand_gen, i, MIN(i + 4, len));
+    c = g_utf8_get_char(g_utf8_offset_to_pointer(alias, i++));
+    if (!g_unichar_isspace(c))
+      g_string_append_unichar(query, g_unichar_tolower(c));
+  }
+  return g_string_free(query, FALSE);
+}
+
+// the kinds of queries timed
+enum kind
+{
+  PREFIX,
+  FUZZY,
+  LAYOUT,
+  WORDS,
+  INFIX,
+  NUM_KINDS
+};
+
+static const char* kind_names[NUM_KINDS] =
+{
+  "prefix", "fuzzy", "layout", "words", "infix"
+};
+
+typedef struct _typed_query
+{
+  gchar* text;
+  guint group;
+  enum kind kind;
+} typed_query;
+
+// the same queries are typed with every number of threads
+static GArray* make_queries(quick_index* index)
+{
+  GArray* queries = g_array_new(FALSE, FALSE, sizeof(typed_query));
+  gint i;
+  for (i = 0; i < num_queries && num_contacts; ++i)
+  {
+    const gchar* alias =
+      roster[g_rand_int_range(rand_gen, 0, num_contacts)].alias;
+    typed_query q = { NULL, 0, (enum kind)(i % NUM_KINDS) };
+    q.text = q.kind == FUZZY ? fuzzy_query(alias) :
+      q.kind == WORDS ? words_query(alias) :
+      q.kind == INFIX ? infix_query(alias) : prefix_query(alias);
+    if (q.kind == LAYOUT)
+    {
+      // typed with the cyrillic layout locked, latin aliases only
+      gchar* converted = quick_index_convert_layout(index, q.text, 0, 1);
+      g_free(q.text);
+      q.text = converted;
+      q.group = 1;
+    }
+    if (q.text && *q.text)
+      g_array_append_val(queries, q);
+    else
+      g_free(q.text);
+  }
+  return queries;
+}
+
+static void free_queries(GArray* queries)
+{
+  guint i;
+  for (i = 0; i < queries->len; ++i)
+    g_free(g_array_index(queries, typed_query, i).text);
+  g_array_free(queries, TRUE);
+}
+
+// checks
+
+// Searches the letter for every match and for a page, failing if either
+// reports an item twice or is slower than allowed, as it would be if the
+// matches were de-duplicated by comparing each with the others.
+static gboolean check_letter(quick_index* index, const gchar* letter)
+{
+  quick_index_stats stats;
+  guint limits[2];
+  gboolean ok = TRUE;
+  guint l, i;
+  quick_index_get_stats(index, &stats);
+  limits[0] = stats.items;
+  limits[1] = QUICK_INDEX_PAGE;
+  for (l = 0; l < G_N_ELEMENTS(limits); ++l)
+  {
+    GHashTable* seen = g_hash_table_new(NULL, NULL);
+    gint64 start = g_get_monotonic_time();
+    guint layout;
+    GArray* ids = quick_index_query(index, letter, 0, limits[l], &layout,
+        NULL);
+    gdouble ms = (g_get_monotonic_time() - start) / 1000.0;
+    for (i = 0; i < ids->len; ++i)
+    {
+      gpointer id = GUINT_TO_POINTER(g_array_index(ids, guint, i) + 1);
+      if (g_hash_table_lookup(seen, id))
+        break;
+      g_hash_table_insert(seen, id, id);
+    }
+    if (i < ids->len)
+    {
+      printf("FAIL %s: item %u reported twice\n", letter,
+          g_array_index(ids, guint, i));
+      ok = FALSE;
+    }
+    if (ms > check_ms)
+    {
+      printf("FAIL %s: %u results in %.1f ms, more than %d ms\n", letter,
+          ids->len, ms, check_ms);
+      ok = FALSE;
+    }
+    else
+      printf("%-4s %7u results in %6.1f ms\n", letter, ids->len, ms);
+    g_hash_table_destroy(seen);
+    g_array_free(ids, TRUE);
+  }
+  return ok;
+}
+
+static gboolean check_letters(quick_index* index)
+{
+  static const gchar* letters[] = { "a", "e", "m", "z" };
+  gboolean ok = TRUE;
+  guint i;
+  for (i = 0; i < G_N_ELEMENTS(letters); ++i)
+    ok = check_letter(index, letters[i]) && ok;
+  return ok;
+}
+
+// the time spent searching in microseconds
+static gint64 run_queries(quick_index* index, GArray* queries)
+{
+  latencies search[NUM_KINDS];
+  latencies render[NUM_KINDS];
+  gint64 total = 0;
+  guint i, j;
+  for (i = 0; i < NUM_KINDS; ++i)
+  {
+    search[i].name = render[i].name = kind_names[i];
+    search[i].samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    render[i].samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+  }
+  for (i = 0; i < queries->len; ++i)
+  {
+    typed_query* q = &g_array_index(queries, typed_query, i);
+    type_query(index, q->text, q->group, &search[q->kind], &render[q->kind]);
+  }
+  printf("keystroke latency, ms      count      p50      p90      p99      max\n");
+  printf(" search\n");
+  for (i = 0; i < NUM_KINDS; ++i)
+  {
+    for (j = 0; j < search[i].samples->len; ++j)
+      total += g_array_index(search[i].samples, gint64, j);
+    report_latencies(&search[i]);
+  }
+  printf(" visible rows\n");
+  for (i = 0; i < NUM_KINDS; ++i)
+    report_latencies(&render[i]);
+  for (i = 0; i < NUM_KINDS; ++i)
+  {
+    g_array_free(search[i].samples, TRUE);
+    g_array_free(render[i].samples, TRUE);
+  }
+  return total;
+}
+
+int main(int argc, char** argv)
+{
+  GOptionContext* context = g_option_context_new(NULL);
+  GError* error = NULL;
+  quick_index* index;
+  GArray* queries;
+  GString* snapshot;
+  glong roster_rss;
+  gint threads;
+  GArray* totals = g_array_new(FALSE, FALSE, sizeof(gint64));
+  g_option_context_set_summary(context, "Measures building and searching "
+      "the QuickPurple index over a synthetic buddy list.");
+  g_option_context_add_main_entries(context, options, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error))
+  {
+    fprintf(stderr, "%s\n", error->message);
+    return 1;
+  }
+  g_option_context_free(context);
+  num_accounts = MAX(num_accounts, 1);
+  num_contacts = MAX(num_contacts, 0);
+  num_threads = MAX(num_threads, 1);
+  setlocale(LC_ALL, "");
+  rand_gen = g_rand_new_with_seed(seed);
+  create_roster();
+  roster_rss = peak_rss();
+  printf("%d contacts, %d accounts, up to %d words, %.0f%% not latin\n",
+      num_contacts, num_accounts, MAX(alias_words, 1), unicode_share * 100);
+
+  index = time_index("build", NULL);
+  print_stats(index);
+  if (check_ms)
+  {
+    gboolean ok = check_letters(index);
+    quick_index_free(index);
+    destroy_roster();
+    g_rand_free(rand_gen);
+    g_array_free(totals, TRUE);
+    return ok ? 0 : 1;
+  }
+  queries = make_queries(index);
+  for (threads = 1;; threads = MIN(threads * 2, num_threads))
+  {
+    gint64 total;
+    if (num_threads > 1)
+      printf("scoring threads  %8d\n", threads);
+    quick_index_set_threads(index, threads);
+    total = run_queries(index, queries);
+    g_array_append_val(totals, total);
+    // the results are the same with any number of threads
+    verbose = FALSE;
+    if (threads == num_threads)
+      break;
+  }
+  if (num_threads > 1)
+  {
+    guint i;
+    printf("scoring threads   search ms  speedup, %u processors\n",
+        g_get_num_processors());
+    for (i = 0, threads = 1; i < totals->len;
+        ++i, threads = MIN(threads * 2, num_threads))
+      printf("  %8d %12.1f %8.2f\n", threads,
+          g_array_index(totals, gint64, i) / 1000.0,
+          (gdouble)g_array_index(totals, gint64, 0)
+          / MAX(g_array_index(totals, gint64, i), 1));
+  }
+  g_array_free(totals, TRUE);
+  free_queries(queries);
+  printf("peak memory      %8ld KiB, %ld KiB before building the index\n",
+      peak_rss(), roster_rss);
+
+  snapshot = quick_index_save(index);
+  quick_index_free(index);
+  index = time_index("snapshot load", snapshot);
+  printf("snapshot         %8u KiB\n", (guint)(snapshot->len / 1024));
+  g_string_free(snapshot, TRUE);
+  quick_index_free(index);
+
+  destroy_roster();
+  g_rand_free(rand_gen);
+  return 0;
+}
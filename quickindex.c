@@ -0,0 +1,2228 @@
+#include "quickindex.h"
+#include <string.h>
+#include <time.h>
+
+typedef struct _item
+{
+  gboolean dead;
+  guint stamp;
+  guint32 text;
+  guint32 text_len;
+} item;
+
+// Words are interned: every distinct word of a layout is one fixed size
+// entry pointing into a string arena holding the casefolded words, and to
+// its posting list, the ascending ids of the items having the word, in an
+// array shared by all the entries.
+typedef struct _entry
+{
+  guint32 key;
+  guint32 key_len;
+  // 0 for words as written, otherwise the word is spelled as typed with
+  // its keys in another layout and this is the group it is written in + 1
+  guint32 layout;
+  guint32 postings;
+  guint32 count;
+} entry;
+
+// Trigrams of the casefolded item texts for substring matching, hashed to
+// 32 bits; items found by them are checked to have the substring anyway.
+typedef struct _gram
+{
+  guint32 key;
+  guint32 postings;
+  guint32 count;
+} gram;
+
+// Word indexes are immutable snapshots with their entries sorted by the
+// bytes of the casefolded words and the posting lists laid out in the same
+// order, a new one is built whenever items are added or removed. Trigrams,
+// sorted by key, are only built in substring mode.
+typedef struct _word_index
+{
+  GArray* entries;
+  GArray* postings;
+  GString* strings;
+  GArray* grams;
+  GArray* gram_postings;
+  guint generation;
+} word_index;
+
+// Keyboard layout tables: the level 0 character of every key in every
+// group and the key producing a character in a group.
+
+#define LAYOUT_KEY(group, c) GUINT_TO_POINTER(((group) << 21) | (c))
+
+struct _quick_layouts
+{
+  gunichar chars[QUICK_INDEX_GROUPS][QUICK_INDEX_KEYCODES];
+  GHashTable* keys;
+};
+
+// Splitting, casefolding and sorting the words of new items runs on a
+// worker thread on copies of their texts, which are merged with the
+// current snapshot into the next one. Searches keep being served by the
+// current snapshot meanwhile, new items are only found by the fuzzy scan
+// until the next one is swapped in on the main thread.
+
+#define BUILD_DELAY 200
+
+typedef struct _index_build
+{
+  quick_index* index;
+  const quick_layouts* layouts;
+  // the snapshot to merge into, NULL to build from the items only
+  word_index* base;
+  GArray* items;
+  // the texts of the items, NUL separated
+  GString* texts;
+  // the dead items whose words are left out and ids reused after the swap
+  GArray* dropped;
+  guint8* drop;
+  gboolean substrings;
+  word_index* result;
+} index_build;
+
+// Items live in fixed size blocks, removed items are only marked dead and
+// their ids are reused once a snapshot without their words has been
+// swapped in.
+
+#define ITEM_BLOCK_SIZE 1024
+
+struct _quick_index
+{
+  quick_index_funcs funcs;
+  gpointer data;
+  word_index* words;
+  GPtrArray* item_blocks;
+  guint num_items;
+  GArray* free_items;
+  GArray* dead_items;
+  // ids freed while they are held, reused once released
+  gboolean hold_ids;
+  GArray* held_items;
+  GArray* pending_items;
+  // full item texts for fuzzy matching and a bit per character class
+  // present in each of them to quickly rule out items
+  GString* texts;
+  GArray* masks;
+  quick_layouts* layouts;
+  // layouts set while a build using the current ones runs
+  quick_layouts* next_layouts;
+  gboolean substrings;
+  // the mode changed while a build runs, all the words are built again
+  gboolean rebuild;
+  GThread* build_thread;
+  index_build* current_build;
+  gboolean build_again;
+  guint build_timeout;
+  GPtrArray* search_stack;
+  guint search_generation;
+  // every search gets a new stamp, an item already carrying it is a duplicate
+  guint search_stamp;
+  // the threads scoring a query, the one running it and the workers
+  guint threads;
+  GThreadPool* score_pool;
+};
+
+// layouts
+
+quick_layouts* quick_layouts_new()
+{
+  quick_layouts* layouts = g_new0(quick_layouts, 1);
+  layouts->keys = g_hash_table_new(g_direct_hash, g_direct_equal);
+  return layouts;
+}
+
+void quick_layouts_add_key(quick_layouts* layouts, guint group,
+    guint keycode, guint level, gunichar c)
+{
+  if (group >= QUICK_INDEX_GROUPS || keycode >= QUICK_INDEX_KEYCODES || !c)
+    return;
+  if (level == 0)
+    layouts->chars[group][keycode] = c;
+  if (!g_hash_table_lookup(layouts->keys, LAYOUT_KEY(group, c)))
+    g_hash_table_insert(layouts->keys, LAYOUT_KEY(group, c),
+        GUINT_TO_POINTER(keycode));
+}
+
+void quick_layouts_free(quick_layouts* layouts)
+{
+  g_hash_table_destroy(layouts->keys);
+  g_free(layouts);
+}
+
+static guint layout_keycode(const quick_layouts* layouts, guint group,
+    gunichar c)
+{
+  return GPOINTER_TO_UINT(g_hash_table_lookup(layouts->keys,
+        LAYOUT_KEY(group, c)));
+}
+
+gchar* quick_index_convert_layout(quick_index* index, const gchar* str,
+    guint from, guint to)
+{
+  GString* result;
+  if (from >= QUICK_INDEX_GROUPS || to >= QUICK_INDEX_GROUPS)
+    return NULL;
+  result = g_string_new(NULL);
+  for (; *str; str = g_utf8_next_char(str))
+  {
+    guint keycode = layout_keycode(index->layouts, from, g_utf8_get_char(str));
+    if (!keycode || !index->layouts->chars[to][keycode])
+    {
+      g_string_free(result, TRUE);
+      return NULL;
+    }
+    g_string_append_unichar(result, index->layouts->chars[to][keycode]);
+  }
+  return g_string_free(result, FALSE);
+}
+
+// words
+
+// Orders entries by the bytes of the casefolded words, spellings of the
+// same word by layout. Unlike collation keys which weigh accents and
+// punctuation after the letters, this keeps all the words starting with a
+// prefix next to each other.
+static gint compare_entries(const gchar* a_strings, const entry* a,
+    const gchar* b_strings, const entry* b)
+{
+  gint result = strcmp(a_strings + a->key, b_strings + b->key);
+  if (!result)
+    result = (gint)a->layout - (gint)b->layout;
+  return result;
+}
+
+static gint compare_entry(gconstpointer a, gconstpointer b, gpointer strings)
+{
+  return compare_entries((gchar*)strings, (entry*)a, (gchar*)strings,
+      (entry*)b);
+}
+
+static gint compare_id(gconstpointer a, gconstpointer b, gpointer data)
+{
+  guint32 x = *(guint32*)a;
+  guint32 y = *(guint32*)b;
+  return x < y ? -1 : x > y;
+}
+
+static guint32 append_string(GString* strings, const gchar* str, gsize len)
+{
+  guint32 offset = strings->len;
+  g_string_append_len(strings, str, len);
+  g_string_append_c(strings, 0);
+  return offset;
+}
+
+static word_index* new_word_index(guint entries, guint postings,
+    gsize strings)
+{
+  word_index* index = g_new0(word_index, 1);
+  index->entries = g_array_sized_new(FALSE, FALSE, sizeof(entry), entries);
+  index->postings = g_array_sized_new(FALSE, FALSE, sizeof(guint32), postings);
+  index->strings = g_string_sized_new(strings);
+  index->grams = g_array_new(FALSE, FALSE, sizeof(gram));
+  index->gram_postings = g_array_new(FALSE, FALSE, sizeof(guint32));
+  return index;
+}
+
+static void free_word_index(word_index* index)
+{
+  g_array_free(index->entries, TRUE);
+  g_array_free(index->postings, TRUE);
+  g_string_free(index->strings, TRUE);
+  g_array_free(index->grams, TRUE);
+  g_array_free(index->gram_postings, TRUE);
+  g_free(index);
+}
+
+// Words are interned as the items are split, only the first occurrence of
+// a word is copied; the occurrences are turned into posting
+// lists once all the items are split.
+typedef struct _word_table
+{
+  word_index* words;
+  // the layout and the word to the entry number + 1
+  GHashTable* ids;
+  GString* lookup;
+  // pairs of entry number and item id
+  GArray* occurrences;
+} word_table;
+
+static void append_entry(word_table* table, const gchar* key, guint id,
+    guint layout)
+{
+  guint n;
+  g_string_truncate(table->lookup, 0);
+  g_string_append_c(table->lookup, '0' + layout);
+  g_string_append(table->lookup, key);
+  n = GPOINTER_TO_UINT(g_hash_table_lookup(table->ids, table->lookup->str));
+  if (!n)
+  {
+    entry e;
+    e.key_len = strlen(key);
+    e.key = append_string(table->words->strings, key, e.key_len);
+    e.layout = layout;
+    e.postings = 0;
+    e.count = 0;
+    g_array_append_val(table->words->entries, e);
+    n = table->words->entries->len;
+    g_hash_table_insert(table->ids, g_strdup(table->lookup->str),
+        GUINT_TO_POINTER(n));
+  }
+  n -= 1;
+  g_array_append_val(table->occurrences, n);
+  g_array_append_val(table->occurrences, id);
+}
+
+// Adds the spellings of a word typed with its keys while another layout
+// is active, so a query typed in the wrong layout matches in one lookup.
+// Nobody types long words in the wrong layout, those have none.
+
+#define MAX_ALTERNATE_CHARS 64
+
+static void append_alternates(word_table* table,
+    const quick_layouts* layouts, const gchar* key, guint id)
+{
+  gunichar chars[MAX_ALTERNATE_CHARS];
+  guint keycodes[MAX_ALTERNATE_CHARS];
+  gchar alt[MAX_ALTERNATE_CHARS * 6 + 1];
+  guint len = 0, i;
+  guint own, group;
+  for (; *key; key = g_utf8_next_char(key))
+  {
+    if (len == MAX_ALTERNATE_CHARS)
+      return;
+    chars[len++] = g_utf8_get_char(key);
+  }
+  // the first layout having keys for all the characters
+  for (own = 0; own < QUICK_INDEX_GROUPS; ++own)
+  {
+    for (i = 0; i < len && (keycodes[i] = layout_keycode(layouts, own, chars[i])); ++i)
+      ;
+    if (i == len)
+      break;
+  }
+  for (group = 0; len && own < QUICK_INDEX_GROUPS && group < QUICK_INDEX_GROUPS; ++group)
+  {
+    gchar* p = alt;
+    gboolean same = TRUE;
+    if (group == own)
+      continue;
+    for (i = 0; i < len && layouts->chars[group][keycodes[i]]; ++i)
+    {
+      same = same && layouts->chars[group][keycodes[i]] == chars[i];
+      p += g_unichar_to_utf8(layouts->chars[group][keycodes[i]], p);
+    }
+    if (i < len || same)
+      continue;
+    *p = 0;
+    p = g_utf8_casefold(alt, -1);
+    append_entry(table, p, id, own + 1);
+    g_free(p);
+  }
+}
+
+static void append_item(word_table* table, const quick_layouts* layouts,
+    const gchar* name, guint id)
+{
+  gchar* folded;
+  gchar* word;
+  gchar* end;
+  // casefolding leaves the separators alone so words are split in place
+  folded = g_utf8_casefold(name, -1);
+  for (word = folded; ; word = end + 1)
+  {
+    gboolean last;
+    end = word + strcspn(word, " \t\v\n\r\f");
+    last = !*end;
+    *end = 0;
+    if (*word)
+    {
+      append_entry(table, word, id, 0);
+      append_alternates(table, layouts, word, id);
+    }
+    if (last)
+      break;
+  }
+  g_free(folded);
+}
+
+// items
+
+static item* get_item(quick_index* index, guint id)
+{
+  item* block = (item*)g_ptr_array_index(index->item_blocks, id / ITEM_BLOCK_SIZE);
+  return &block[id % ITEM_BLOCK_SIZE];
+}
+
+static guint64 char_mask(gunichar c)
+{
+  if (c >= 'a' && c <= 'z')
+    return (guint64)1 << (c - 'a');
+  if (c >= '0' && c <= '9')
+    return (guint64)1 << (26 + c - '0');
+  return (guint64)1 << (36 + c % 28);
+}
+
+static void compact_items(quick_index* index)
+{
+  GString* texts = g_string_sized_new(index->texts->len);
+  guint id;
+  for (id = 0; id < index->num_items; ++id)
+  {
+    item* val = get_item(index, id);
+    if (!val->dead)
+      val->text = append_string(texts, index->texts->str + val->text, val->text_len);
+  }
+  g_string_free(index->texts, TRUE);
+  index->texts = texts;
+}
+
+// building
+
+static gboolean on_build_done(gpointer data);
+
+// Lays out the posting lists of the interned words, ascending and without
+// the duplicates of words occurring twice in an item.
+static void fill_postings(word_index* words, GArray* occurrences)
+{
+  entry* entries = (entry*)words->entries->data;
+  const guint32* occ = (const guint32*)occurrences->data;
+  guint32* postings;
+  guint i, j, n = occurrences->len / 2, total = 0;
+  for (i = 0; i < n; ++i)
+    ++entries[occ[2 * i]].count;
+  for (i = 0; i < words->entries->len; ++i)
+  {
+    entries[i].postings = total;
+    total += entries[i].count;
+    entries[i].count = 0;
+  }
+  g_array_set_size(words->postings, total);
+  postings = (guint32*)words->postings->data;
+  for (i = 0; i < n; ++i)
+  {
+    entry* e = &entries[occ[2 * i]];
+    postings[e->postings + e->count++] = occ[2 * i + 1];
+  }
+  for (i = 0; i < words->entries->len; ++i)
+  {
+    guint32* p = postings + entries[i].postings;
+    guint len = entries[i].count ? 1 : 0;
+    // items are split in the order they were added, reused ids break it
+    for (j = 1; j < entries[i].count && p[j - 1] < p[j]; ++j)
+      ;
+    if (j < entries[i].count)
+      g_qsort_with_data(p, entries[i].count, sizeof(guint32), compare_id, NULL);
+    for (j = 1; j < entries[i].count; ++j)
+      if (p[j] != p[len - 1])
+        p[len++] = p[j];
+    entries[i].count = len;
+  }
+}
+
+// Appends the union of two ascending posting lists leaving out the items
+// dropped.
+static void merge_postings(GArray* postings, const guint32* a, guint na,
+    const guint32* b, guint nb, const guint8* drop)
+{
+  guint i = 0, j = 0;
+  while (i < na || j < nb)
+  {
+    guint32 id;
+    if (j == nb || (i < na && a[i] < b[j]))
+      id = a[i++];
+    else
+    {
+      if (i < na && a[i] == b[j])
+        ++i;
+      id = b[j++];
+    }
+    if (!drop || !drop[id])
+      g_array_append_val(postings, id);
+  }
+}
+
+// trigrams
+
+static guint32 gram_key(gunichar a, gunichar b, gunichar c)
+{
+  return (a * 0x9e3779b1u) ^ (b * 0x85ebca6bu) ^ (c * 0xc2b2ae35u);
+}
+
+// appends the trigrams of the text as keys shifted above the item id
+static void append_grams(GArray* pairs, const gchar* text, guint id)
+{
+  gchar* folded = g_utf8_casefold(text, -1);
+  const gchar* p;
+  gunichar a = 0, b = 0;
+  guint n = 0;
+  for (p = folded; *p; p = g_utf8_next_char(p))
+  {
+    gunichar c = g_utf8_get_char(p);
+    if (++n >= 3)
+    {
+      guint64 pair = (guint64)gram_key(a, b, c) << 32 | id;
+      g_array_append_val(pairs, pair);
+    }
+    a = b;
+    b = c;
+  }
+  g_free(folded);
+}
+
+static gint compare_pair(gconstpointer a, gconstpointer b, gpointer data)
+{
+  guint64 x = *(guint64*)a;
+  guint64 y = *(guint64*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Sorts the pairs into trigrams with ascending posting lists.
+static void fill_grams(word_index* words, GArray* pairs)
+{
+  guint64* p = (guint64*)pairs->data;
+  guint i;
+  g_qsort_with_data(p, pairs->len, sizeof(guint64), compare_pair, NULL);
+  for (i = 0; i < pairs->len; ++i)
+  {
+    guint32 key = p[i] >> 32;
+    guint32 id = (guint32)p[i];
+    gram* last = words->grams->len ?
+      &g_array_index(words->grams, gram, words->grams->len - 1) : NULL;
+    if (i && p[i] == p[i - 1])
+      continue;
+    if (!last || last->key != key)
+    {
+      gram g = {key, words->gram_postings->len, 0};
+      g_array_append_val(words->grams, g);
+      last = &g_array_index(words->grams, gram, words->grams->len - 1);
+    }
+    g_array_append_val(words->gram_postings, id);
+    ++last->count;
+  }
+}
+
+static void merge_grams(word_index* result, word_index* base,
+    word_index* fresh, const guint8* drop)
+{
+  const gram* a = base ? (const gram*)base->grams->data : NULL;
+  const gram* b = (const gram*)fresh->grams->data;
+  guint i = 0, j = 0, na = base ? base->grams->len : 0, nb = fresh->grams->len;
+  while (i < na || j < nb)
+  {
+    gint order = i == na ? 1 : j == nb ? -1 :
+      (a[i].key > b[j].key) - (a[i].key < b[j].key);
+    gram g;
+    g.key = order <= 0 ? a[i].key : b[j].key;
+    g.postings = result->gram_postings->len;
+    merge_postings(result->gram_postings,
+        order <= 0 ? (guint32*)base->gram_postings->data + a[i].postings : NULL,
+        order <= 0 ? a[i].count : 0,
+        order >= 0 ? (guint32*)fresh->gram_postings->data + b[j].postings : NULL,
+        order >= 0 ? b[j].count : 0, drop);
+    if (order <= 0)
+      ++i;
+    if (order >= 0)
+      ++j;
+    g.count = result->gram_postings->len - g.postings;
+    if (g.count)
+      g_array_append_val(result->grams, g);
+  }
+}
+
+static gpointer build_index(gpointer data)
+{
+  index_build* build = (index_build*)data;
+  word_index* base = build->base;
+  word_index* fresh;
+  word_index* result;
+  word_table table;
+  const gchar* text = build->texts->str;
+  const entry* a = base ? (const entry*)base->entries->data : NULL;
+  const entry* b;
+  guint i = 0, j = 0, na = base ? base->entries->len : 0, nb;
+  // about a word per 6 bytes of text, most of them repeated
+  table.words = new_word_index(build->texts->len / 24, build->texts->len / 6,
+      build->texts->len);
+  table.ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  table.lookup = g_string_new(NULL);
+  table.occurrences = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+      build->texts->len / 3);
+  for (i = 0; i < build->items->len; ++i)
+  {
+    append_item(&table, build->layouts, text,
+        g_array_index(build->items, guint, i));
+    text += strlen(text) + 1;
+  }
+  fresh = table.words;
+  g_hash_table_destroy(table.ids);
+  g_string_free(table.lookup, TRUE);
+  fill_postings(fresh, table.occurrences);
+  g_array_free(table.occurrences, TRUE);
+  g_qsort_with_data(fresh->entries->data, fresh->entries->len, sizeof(entry),
+      compare_entry, fresh->strings->str);
+  // merged with the base even without one to lay the posting lists out in
+  // the order of the entries
+  b = (const entry*)fresh->entries->data;
+  nb = fresh->entries->len;
+  result = new_word_index(na + nb,
+      (base ? base->postings->len : 0) + fresh->postings->len,
+      (base ? base->strings->len : 0) + fresh->strings->len);
+  i = 0;
+  while (i < na || j < nb)
+  {
+    gint order = i == na ? 1 : j == nb ? -1 : compare_entries(
+        base->strings->str, &a[i], fresh->strings->str, &b[j]);
+    const gchar* strings = order <= 0 ? base->strings->str : fresh->strings->str;
+    entry e = order <= 0 ? a[i] : b[j];
+    e.postings = result->postings->len;
+    merge_postings(result->postings,
+        order <= 0 ? (guint32*)base->postings->data + a[i].postings : NULL,
+        order <= 0 ? a[i].count : 0,
+        order >= 0 ? (guint32*)fresh->postings->data + b[j].postings : NULL,
+        order >= 0 ? b[j].count : 0, build->drop);
+    if (order <= 0)
+      ++i;
+    if (order >= 0)
+      ++j;
+    e.count = result->postings->len - e.postings;
+    if (!e.count)
+      continue;
+    e.key = append_string(result->strings, strings + e.key, e.key_len);
+    g_array_append_val(result->entries, e);
+  }
+  if (build->substrings)
+  {
+    // about a trigram per byte of text
+    GArray* pairs = g_array_sized_new(FALSE, FALSE, sizeof(guint64),
+        build->texts->len);
+    text = build->texts->str;
+    for (i = 0; i < build->items->len; ++i)
+    {
+      append_grams(pairs, text, g_array_index(build->items, guint, i));
+      text += strlen(text) + 1;
+    }
+    fill_grams(fresh, pairs);
+    g_array_free(pairs, TRUE);
+    merge_grams(result, base, fresh, build->drop);
+  }
+  free_word_index(fresh);
+  build->result = result;
+  g_idle_add(on_build_done, build);
+  return NULL;
+}
+
+static void free_build(index_build* build)
+{
+  g_array_free(build->items, TRUE);
+  g_string_free(build->texts, TRUE);
+  g_array_free(build->dropped, TRUE);
+  g_free(build->drop);
+  g_free(build);
+}
+
+static void start_build(quick_index* index, gboolean full)
+{
+  index_build* build = g_new0(index_build, 1);
+  guint i;
+  if (index->build_timeout)
+    g_source_remove(index->build_timeout);
+  index->build_timeout = 0;
+  index->build_again = FALSE;
+  if (full)
+  {
+    g_array_set_size(index->pending_items, 0);
+    for (i = 0; i < index->num_items; ++i)
+      g_array_append_val(index->pending_items, i);
+  }
+  if (full)
+    index->rebuild = FALSE;
+  build->index = index;
+  build->layouts = index->layouts;
+  build->substrings = index->substrings;
+  build->base = full ? NULL : index->words;
+  build->items = g_array_new(FALSE, FALSE, sizeof(guint));
+  build->texts = g_string_new(NULL);
+  for (i = 0; i < index->pending_items->len; ++i)
+  {
+    guint id = g_array_index(index->pending_items, guint, i);
+    item* val = get_item(index, id);
+    if (val->dead || !val->text_len)
+      continue;
+    g_array_append_val(build->items, id);
+    append_string(build->texts, index->texts->str + val->text, val->text_len);
+  }
+  g_array_set_size(index->pending_items, 0);
+  build->dropped = index->dead_items;
+  index->dead_items = g_array_new(FALSE, FALSE, sizeof(guint));
+  if (build->base && build->dropped->len)
+  {
+    build->drop = g_new0(guint8, index->num_items);
+    for (i = 0; i < build->dropped->len; ++i)
+      build->drop[g_array_index(build->dropped, guint, i)] = 1;
+  }
+  index->current_build = build;
+  index->build_thread = g_thread_new("quick-index", build_index, build);
+}
+
+static gboolean on_build_done(gpointer data)
+{
+  index_build* build = (index_build*)data;
+  quick_index* index = build->index;
+  g_thread_join(index->build_thread);
+  index->build_thread = NULL;
+  index->current_build = NULL;
+  build->result->generation = index->words->generation + 1;
+  free_word_index(index->words);
+  index->words = build->result;
+  g_array_append_vals(index->hold_ids ? index->held_items : index->free_items,
+      build->dropped->data, build->dropped->len);
+  free_build(build);
+  compact_items(index);
+  if (index->funcs.built)
+    index->funcs.built(index, index->data);
+  // the worker read the layouts, those set meanwhile are only used now
+  if (index->next_layouts)
+  {
+    quick_layouts_free(index->layouts);
+    index->layouts = index->next_layouts;
+    index->next_layouts = NULL;
+    start_build(index, TRUE);
+  }
+  else if (index->rebuild)
+    start_build(index, TRUE);
+  else if (index->build_again)
+    start_build(index, FALSE);
+  return FALSE;
+}
+
+void quick_index_build(quick_index* index)
+{
+  if (index->build_thread)
+    index->build_again = TRUE;
+  else if (index->pending_items->len || index->dead_items->len)
+    start_build(index, FALSE);
+  else if (index->build_timeout)
+  {
+    // nothing is left to build after loading a snapshot
+    g_source_remove(index->build_timeout);
+    index->build_timeout = 0;
+  }
+}
+
+static gboolean on_build_timeout(gpointer data)
+{
+  quick_index* index = (quick_index*)data;
+  index->build_timeout = 0;
+  quick_index_build(index);
+  return FALSE;
+}
+
+static void index_changed(quick_index* index)
+{
+  if (index->build_thread)
+    index->build_again = TRUE;
+  else
+  {
+    if (index->build_timeout)
+      g_source_remove(index->build_timeout);
+    index->build_timeout = g_timeout_add(BUILD_DELAY, on_build_timeout, index);
+  }
+}
+
+
+gboolean quick_index_building(quick_index* index)
+{
+  return index->build_thread || index->build_timeout;
+}
+
+void quick_index_set_layouts(quick_index* index, quick_layouts* layouts)
+{
+  if (index->build_thread)
+  {
+    if (index->next_layouts)
+      quick_layouts_free(index->next_layouts);
+    index->next_layouts = layouts;
+    return;
+  }
+  quick_layouts_free(index->layouts);
+  index->layouts = layouts;
+  if (index->num_items)
+    start_build(index, TRUE);
+}
+
+void quick_index_set_substrings(quick_index* index, gboolean substrings)
+{
+  if (!index->substrings == !substrings)
+    return;
+  index->substrings = substrings;
+  if (index->build_thread)
+    index->rebuild = TRUE;
+  else if (index->num_items)
+    start_build(index, TRUE);
+}
+
+static void score_worker(gpointer data, gpointer user_data);
+
+void quick_index_set_threads(quick_index* index, guint threads)
+{
+  threads = MAX(threads, 1);
+  if (threads == index->threads)
+    return;
+  if (index->score_pool)
+    g_thread_pool_free(index->score_pool, FALSE, TRUE);
+  index->score_pool = threads > 1 ? g_thread_pool_new(score_worker, NULL,
+      threads - 1, TRUE, NULL) : NULL;
+  index->threads = threads;
+}
+
+quick_index* quick_index_new(const quick_index_funcs* funcs, gpointer data)
+{
+  quick_index* index = g_new0(quick_index, 1);
+  if (funcs)
+    index->funcs = *funcs;
+  index->data = data;
+  index->words = new_word_index(0, 0, 0);
+  index->item_blocks = g_ptr_array_new_with_free_func(g_free);
+  index->free_items = g_array_new(FALSE, FALSE, sizeof(guint));
+  index->dead_items = g_array_new(FALSE, FALSE, sizeof(guint));
+  index->held_items = g_array_new(FALSE, FALSE, sizeof(guint));
+  index->pending_items = g_array_new(FALSE, FALSE, sizeof(guint));
+  index->texts = g_string_new(NULL);
+  index->masks = g_array_new(FALSE, TRUE, sizeof(guint64));
+  index->layouts = quick_layouts_new();
+  index->threads = 1;
+  return index;
+}
+
+void quick_index_free(quick_index* index)
+{
+  if (index->build_timeout)
+    g_source_remove(index->build_timeout);
+  if (index->build_thread)
+  {
+    g_thread_join(index->build_thread);
+    g_source_remove_by_user_data(index->current_build);
+    free_word_index(index->current_build->result);
+    free_build(index->current_build);
+  }
+  if (index->search_stack)
+    g_ptr_array_free(index->search_stack, TRUE);
+  if (index->score_pool)
+    g_thread_pool_free(index->score_pool, FALSE, TRUE);
+  if (index->next_layouts)
+    quick_layouts_free(index->next_layouts);
+  quick_layouts_free(index->layouts);
+  g_ptr_array_free(index->item_blocks, TRUE);
+  g_array_free(index->free_items, TRUE);
+  g_array_free(index->dead_items, TRUE);
+  g_array_free(index->held_items, TRUE);
+  g_array_free(index->pending_items, TRUE);
+  g_string_free(index->texts, TRUE);
+  g_array_free(index->masks, TRUE);
+  free_word_index(index->words);
+  g_free(index);
+}
+
+guint quick_index_add(quick_index* index, const gchar* text)
+{
+  guint id;
+  item* val;
+  guint64 mask = 0;
+  const gchar* p;
+  if (index->free_items->len)
+  {
+    id = g_array_index(index->free_items, guint, index->free_items->len - 1);
+    g_array_set_size(index->free_items, index->free_items->len - 1);
+  }
+  else
+  {
+    id = index->num_items++;
+    if (id % ITEM_BLOCK_SIZE == 0)
+      g_ptr_array_add(index->item_blocks, g_new(item, ITEM_BLOCK_SIZE));
+    g_array_set_size(index->masks, index->num_items);
+  }
+  val = get_item(index, id);
+  memset(val, 0, sizeof(item));
+  if (text)
+  {
+    val->text_len = strlen(text);
+    val->text = append_string(index->texts, text, val->text_len);
+    for (p = text; *p; p = g_utf8_next_char(p))
+      mask |= char_mask(g_unichar_tolower(g_utf8_get_char(p)));
+    g_array_append_val(index->pending_items, id);
+    index_changed(index);
+  }
+  g_array_index(index->masks, guint64, id) = mask;
+  return id;
+}
+
+void quick_index_remove(quick_index* index, guint id)
+{
+  item* val = get_item(index, id);
+  if (val->dead)
+    return;
+  val->dead = TRUE;
+  g_array_index(index->masks, guint64, id) = 0;
+  // the id is reused only once no entry refers to it anymore
+  g_array_append_val(index->dead_items, id);
+  index_changed(index);
+}
+
+void quick_index_hold_ids(quick_index* index, gboolean hold)
+{
+  index->hold_ids = hold;
+  if (hold)
+    return;
+  g_array_append_vals(index->free_items, index->held_items->data,
+      index->held_items->len);
+  g_array_set_size(index->held_items, 0);
+}
+
+guint quick_index_update(quick_index* index, guint id, const gchar* text)
+{
+  quick_index_remove(index, id);
+  return quick_index_add(index, text);
+}
+
+const gchar* quick_index_get_text(quick_index* index, guint id)
+{
+  item* val = get_item(index, id);
+  return val->text_len ? index->texts->str + val->text : NULL;
+}
+
+void quick_index_get_stats(quick_index* index, quick_index_stats* stats)
+{
+  stats->items = index->num_items;
+  stats->words = index->words->entries->len;
+  stats->words_size = index->words->entries->len * sizeof(entry);
+  stats->postings = index->words->postings->len;
+  stats->postings_size = index->words->postings->len * sizeof(guint32);
+  stats->grams = index->words->grams->len;
+  stats->grams_size = index->words->grams->len * sizeof(gram)
+    + index->words->gram_postings->len * sizeof(guint32);
+  stats->strings_size = index->words->strings->len;
+  stats->items_size = index->item_blocks->len * ITEM_BLOCK_SIZE * sizeof(item);
+  stats->texts_size = index->texts->len;
+  stats->masks_size = index->masks->len * sizeof(guint64);
+}
+
+// prefix search
+
+static gboolean entry_has_prefix(word_index* index, const entry* e,
+    const gchar* key, guint len)
+{
+  return e->key_len >= len && !memcmp(index->strings->str + e->key, key, len);
+}
+
+// Words starting with a query are a contiguous range of the entries and
+// those starting with a longer query are a subrange of it, so searches
+// narrow down the ranges of the previous queries kept on a stack which is
+// unwound on backspace.
+
+typedef struct _prefix_range
+{
+  gchar* key;
+  guint len;
+  guint lo;
+  guint hi;
+} prefix_range;
+
+static void free_prefix_range(gpointer data)
+{
+  prefix_range* r = (prefix_range*)data;
+  g_free(r->key);
+  g_free(r);
+}
+
+static prefix_range* narrow_range(word_index* index, prefix_range* from,
+    gchar* key)
+{
+  entry* entries = (entry*)index->entries->data;
+  prefix_range* r = g_new(prefix_range, 1);
+  guint lo = from ? from->lo : 0;
+  guint hi = from ? from->hi : index->entries->len;
+  r->key = key;
+  r->len = strlen(key);
+  // lower bound followed by a linear prefix scan
+  while (lo < hi)
+  {
+    guint mid = lo + (hi - lo) / 2;
+    if (strcmp(index->strings->str + entries[mid].key, key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  r->lo = lo;
+  hi = from ? from->hi : index->entries->len;
+  while (lo < hi && entry_has_prefix(index, &entries[lo], key, r->len))
+    ++lo;
+  r->hi = lo;
+  return r;
+}
+
+// takes the casefolded key
+static prefix_range* find_range(quick_index* index, gchar* key)
+{
+  guint len = strlen(key);
+  GPtrArray* stack;
+  prefix_range* from = NULL;
+  prefix_range* r;
+  if (!index->search_stack)
+    index->search_stack = g_ptr_array_new_with_free_func(free_prefix_range);
+  stack = index->search_stack;
+  if (index->search_generation != index->words->generation)
+  {
+    g_ptr_array_set_size(stack, 0);
+    index->search_generation = index->words->generation;
+  }
+  // drop queries which are not a prefix of this one
+  while (stack->len)
+  {
+    from = (prefix_range*)g_ptr_array_index(stack, stack->len - 1);
+    if (from->len <= len && !memcmp(from->key, key, from->len))
+      break;
+    g_ptr_array_set_size(stack, stack->len - 1);
+    from = NULL;
+  }
+  if (from && from->len == len)
+  {
+    g_free(key);
+    return from;
+  }
+  r = narrow_range(index->words, from, key);
+  g_ptr_array_add(stack, r);
+  return r;
+}
+
+// the layout matches are taken from, words as written win over spellings
+// typed in another layout
+static guint range_layout(quick_index* index, prefix_range* r)
+{
+  const entry* entries = (const entry*)index->words->entries->data;
+  const guint32* postings = (const guint32*)index->words->postings->data;
+  guint i, j, layout = 0;
+  for (i = r->lo; i < r->hi; ++i)
+  {
+    const guint32* p = postings + entries[i].postings;
+    if (layout && entries[i].layout)
+      continue;
+    for (j = 0; j < entries[i].count; ++j)
+      if (!get_item(index, p[j])->dead)
+      {
+        if (!entries[i].layout)
+          return 0;
+        layout = entries[i].layout;
+        break;
+      }
+  }
+  return layout;
+}
+
+// several words
+
+// Every word of a query has to start a word of the items matched. Their
+// item sets are intersected starting with the smallest, the candidates
+// left being looked up in the posting lists of the other words.
+
+// the number of postings of the entries of the layout in the range, an
+// upper bound of the number of items they have
+static guint range_size(quick_index* index, prefix_range* r, guint layout)
+{
+  const entry* entries = (const entry*)index->words->entries->data;
+  guint i, size = 0;
+  for (i = r->lo; i < r->hi; ++i)
+    if (entries[i].layout == layout)
+      size += entries[i].count;
+  return size;
+}
+
+// sets the bits of the items of the entries of the layout in the range
+static void range_bits(quick_index* index, prefix_range* r, guint layout,
+    guint64* bits)
+{
+  const entry* entries = (const entry*)index->words->entries->data;
+  const guint32* postings = (const guint32*)index->words->postings->data;
+  guint i, j;
+  for (i = r->lo; i < r->hi; ++i)
+    if (entries[i].layout == layout)
+      for (j = 0; j < entries[i].count; ++j)
+      {
+        guint32 id = postings[entries[i].postings + j];
+        bits[id / 64] |= (guint64)1 << (id % 64);
+      }
+}
+
+// The live items of the entries of the layout in the range, ascending. The
+// posting lists of several entries are merged through the bitmap, which
+// is left cleared.
+static GArray* range_items(quick_index* index, prefix_range* r, guint layout,
+    guint64* bits)
+{
+  const entry* entries = (const entry*)index->words->entries->data;
+  const guint32* postings = (const guint32*)index->words->postings->data;
+  GArray* ids = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+      range_size(index, r, layout));
+  guint i, j = 0, lists = 0;
+  for (i = r->lo; i < r->hi && lists < 2; ++i)
+    if (entries[i].layout == layout)
+    {
+      j = i;
+      ++lists;
+    }
+  if (lists == 1)
+  {
+    for (i = 0; i < entries[j].count; ++i)
+      if (!get_item(index, postings[entries[j].postings + i])->dead)
+        g_array_append_val(ids, postings[entries[j].postings + i]);
+    return ids;
+  }
+  range_bits(index, r, layout, bits);
+  for (i = 0; i < (index->num_items + 63) / 64; ++i)
+    if (bits[i])
+    {
+      for (j = 0; j < 64; ++j)
+        if ((bits[i] >> j) & 1)
+        {
+          guint32 id = i * 64 + j;
+          if (!get_item(index, id)->dead)
+            g_array_append_val(ids, id);
+        }
+      bits[i] = 0;
+    }
+  return ids;
+}
+
+// the first position from lo of an id not less than x, probing steps
+// doubling in length before the binary search
+static guint gallop(const guint32* ids, guint lo, guint n, guint32 x)
+{
+  guint hi = lo, step = 1;
+  while (hi < n && ids[hi] < x)
+  {
+    lo = hi + 1;
+    hi += step;
+    step *= 2;
+  }
+  hi = MIN(hi, n);
+  while (lo < hi)
+  {
+    guint mid = lo + (hi - lo) / 2;
+    if (ids[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Marks the candidates in the posting list, walking the shorter of the two
+// and galloping through the longer one.
+static void mark_postings(const guint32* candidates, guint n,
+    const guint32* list, guint m, guint8* found)
+{
+  guint i = 0, j = 0;
+  if (m <= n)
+    for (; j < m && i < n; ++j)
+    {
+      i = gallop(candidates, i, n, list[j]);
+      if (i < n && candidates[i] == list[j])
+        found[i] = 1;
+    }
+  else
+    for (; i < n && j < m; ++i)
+    {
+      j = gallop(list, j, m, candidates[i]);
+      if (j < m && list[j] == candidates[i])
+        found[i] = 1;
+    }
+}
+
+static gint compare_range_size(gconstpointer a, gconstpointer b,
+    gpointer data)
+{
+  return (gint)(*(guint*)a > *(guint*)b) - (gint)(*(guint*)a < *(guint*)b);
+}
+
+// The live items having words starting with each of the ranges,
+// ascending. Candidates are looked up in a range by galloping through its
+// posting lists or, when it has more lists than candidates, in a bitmap
+// of its items.
+static GArray* match_ranges(quick_index* index, prefix_range** ranges,
+    guint n, guint layout)
+{
+  const entry* entries = (const entry*)index->words->entries->data;
+  const guint32* postings = (const guint32*)index->words->postings->data;
+  guint words = (index->num_items + 63) / 64;
+  guint64* bits = g_new0(guint64, words);
+  // pairs of range size and range number
+  guint* order = g_new(guint, 2 * n);
+  GArray* ids;
+  guint8* found;
+  guint i, j, k, len;
+  for (i = 0; i < n; ++i)
+  {
+    order[2 * i] = range_size(index, ranges[i], layout);
+    order[2 * i + 1] = i;
+  }
+  g_qsort_with_data(order, n, 2 * sizeof(guint), compare_range_size, NULL);
+  ids = range_items(index, ranges[order[1]], layout, bits);
+  found = g_new(guint8, ids->len);
+  for (i = 1; i < n && ids->len; ++i)
+  {
+    prefix_range* r = ranges[order[2 * i + 1]];
+    guint32* p = (guint32*)ids->data;
+    memset(found, 0, ids->len);
+    if (r->hi - r->lo > ids->len)
+    {
+      range_bits(index, r, layout, bits);
+      for (k = 0; k < ids->len; ++k)
+        found[k] = (bits[p[k] / 64] >> (p[k] % 64)) & 1;
+      memset(bits, 0, words * sizeof(guint64));
+    }
+    else
+      for (j = r->lo; j < r->hi; ++j)
+        if (entries[j].layout == layout)
+          mark_postings(p, ids->len, postings + entries[j].postings,
+              entries[j].count, found);
+    for (k = 0, len = 0; k < ids->len; ++k)
+      if (found[k])
+        p[len++] = p[k];
+    g_array_set_size(ids, len);
+  }
+  g_free(found);
+  g_free(order);
+  g_free(bits);
+  return ids;
+}
+
+// fuzzy matching
+
+#define MAX_TEXT_CHARS 256
+// words starting with the query rank above anything matched fuzzily
+#define PREFIX_TIER (1 << 16)
+// then items containing the query in substring mode
+#define SUBSTRING_TIER (1 << 15)
+
+enum
+{
+  SCORE_MATCH = 16,
+  SCORE_GAP_START = -3,
+  SCORE_GAP_EXTENSION = -1,
+  BONUS_BOUNDARY = 8,
+  BONUS_CAMEL = 7,
+  BONUS_CONSECUTIVE = 4,
+  BONUS_FIRST_CHAR_MULTIPLIER = 2
+};
+
+typedef struct _match
+{
+  gint score;
+  guint id;
+} match;
+
+static gint char_bonus(gunichar prev, gunichar c)
+{
+  if (!g_unichar_isalnum(prev) && g_unichar_isalnum(c))
+    return BONUS_BOUNDARY;
+  if ((g_unichar_islower(prev) && g_unichar_isupper(c)) ||
+      (!g_unichar_isdigit(prev) && g_unichar_isdigit(c)))
+    return BONUS_CAMEL;
+  return 0;
+}
+
+// Scores the shortest window of the text ending at the leftmost complete
+// occurrence of the query as a subsequence, -1 if there is none. Matches
+// at word starts, camelCase humps and runs of consecutive matches score
+// higher, gaps are penalized.
+static gint fuzzy_score(const gunichar* query, guint qlen, const gchar* text)
+{
+  gunichar chars[MAX_TEXT_CHARS];
+  guint n = 0, i, j, start, end;
+  gint score = 0, run_bonus = 0;
+  gboolean in_gap = FALSE;
+  for (; *text && n < MAX_TEXT_CHARS; text = g_utf8_next_char(text))
+    chars[n++] = g_utf8_get_char(text);
+  for (i = 0, j = 0; i < n && j < qlen; ++i)
+    if (g_unichar_tolower(chars[i]) == query[j])
+      ++j;
+  if (j < qlen)
+    return -1;
+  end = i;
+  for (j = qlen; j > 0; )
+    if (g_unichar_tolower(chars[--i]) == query[j - 1])
+      --j;
+  start = i;
+  for (i = start, j = 0; i < end; ++i)
+  {
+    if (j < qlen && g_unichar_tolower(chars[i]) == query[j])
+    {
+      gint bonus = char_bonus(i ? chars[i - 1] : ' ', chars[i]);
+      if (j == 0 || in_gap)
+        run_bonus = bonus;
+      else
+        run_bonus = MAX(MAX(run_bonus, bonus), BONUS_CONSECUTIVE);
+      score += SCORE_MATCH +
+        (j == 0 ? run_bonus * BONUS_FIRST_CHAR_MULTIPLIER : run_bonus);
+      in_gap = FALSE;
+      ++j;
+    }
+    else
+    {
+      score += in_gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+      in_gap = TRUE;
+    }
+  }
+  return MAX(score, 0);
+}
+
+static gboolean match_better(quick_index* index, const match* a,
+    const match* b)
+{
+  guint alen, blen;
+  if (a->score != b->score)
+    return a->score > b->score;
+  alen = get_item(index, a->id)->text_len;
+  blen = get_item(index, b->id)->text_len;
+  if (alen != blen)
+    return alen < blen;
+  return a->id < b->id;
+}
+
+static gint compare_match(gconstpointer a, gconstpointer b, gpointer index)
+{
+  return match_better((quick_index*)index, (match*)a, (match*)b) ? -1 : 1;
+}
+
+// keeps the best limit matches in a heap with the worst one on top
+static void push_match(quick_index* index, GArray* heap, guint limit,
+    gint score, guint id)
+{
+  match m = {score, id};
+  match* h = (match*)heap->data;
+  guint i = 0;
+  if (!limit)
+    return;
+  if (heap->len < limit)
+  {
+    g_array_append_val(heap, m);
+    h = (match*)heap->data;
+    for (i = heap->len - 1; i > 0 && match_better(index, &h[(i - 1) / 2], &h[i]);
+        i = (i - 1) / 2)
+    {
+      m = h[i];
+      h[i] = h[(i - 1) / 2];
+      h[(i - 1) / 2] = m;
+    }
+  }
+  else if (match_better(index, &m, &h[0]))
+  {
+    h[0] = m;
+    for (;;)
+    {
+      guint l = 2 * i + 1, r = l + 1, worst = i;
+      if (l < heap->len && match_better(index, &h[worst], &h[l]))
+        worst = l;
+      if (r < heap->len && match_better(index, &h[worst], &h[r]))
+        worst = r;
+      if (worst == i)
+        break;
+      m = h[i];
+      h[i] = h[worst];
+      h[worst] = m;
+      i = worst;
+    }
+  }
+}
+
+static gint item_bonus(quick_index* index, guint id, gint64 now)
+{
+  return index->funcs.bonus ? index->funcs.bonus(id, now, index->data) : 0;
+}
+
+// the candidate unless it is dead or found already
+static void add_candidate(quick_index* index, GArray* ids, guint32 id)
+{
+  item* val = get_item(index, id);
+  if (val->dead || val->stamp == index->search_stamp)
+    return;
+  val->stamp = index->search_stamp;
+  g_array_append_val(ids, id);
+}
+
+// parallel scoring
+
+// Candidates are scored in fixed chunks taken in turn by the thread running
+// the query and the workers of a pool kept by the index, each keeping the
+// best matches of its chunks in a heap of its own merged at the end. Items
+// are only read meanwhile, the thread running the query waits for the
+// workers before returning. It polls for cancellation between its chunks
+// while some are left, the workers stop taking chunks once it is set.
+
+#define SCORE_CHUNK 2048
+
+typedef struct _score_job
+{
+  quick_index* index;
+  const gunichar* query;
+  guint qlen;
+  guint64 qmask;
+  gint64 now;
+  guint limit;
+  GArray* heap;
+  // the candidates scored in the tier, NULL to scan all the items not
+  // found already
+  const guint32* ids;
+  guint count;
+  gint tier;
+  volatile gint next;
+  volatile gint cancelled;
+  guint running;
+  GMutex lock;
+  GCond done;
+} score_job;
+
+static void score_chunk(score_job* job, GArray* heap, guint from, guint to)
+{
+  quick_index* index = job->index;
+  guint i;
+  if (job->ids)
+  {
+    for (i = from; i < to; ++i)
+    {
+      guint id = job->ids[i];
+      push_match(index, heap, job->limit, job->tier +
+          item_bonus(index, id, job->now) + MAX(fuzzy_score(job->query,
+              job->qlen, index->texts->str + get_item(index, id)->text), 0),
+          id);
+    }
+    return;
+  }
+  // the mask check is a tight loop over a dense array which rules out
+  // most items before their text is decoded
+  for (i = from; i < to; ++i)
+    if ((g_array_index(index->masks, guint64, i) & job->qmask) == job->qmask
+        && get_item(index, i)->stamp != index->search_stamp)
+    {
+      gint score = fuzzy_score(job->query, job->qlen,
+          index->texts->str + get_item(index, i)->text);
+      if (score >= 0)
+        push_match(index, heap, job->limit,
+            score + item_bonus(index, i, job->now), i);
+    }
+}
+
+static gboolean query_cancelled(quick_index* index)
+{
+  return index->funcs.cancelled && index->funcs.cancelled(index->data);
+}
+
+static void score_chunks(score_job* job, gboolean poll)
+{
+  GArray* heap = g_array_sized_new(FALSE, FALSE, sizeof(match), job->limit);
+  guint i;
+  while (!g_atomic_int_get(&job->cancelled))
+  {
+    guint from = g_atomic_int_add(&job->next, SCORE_CHUNK);
+    if (from >= job->count)
+      break;
+    score_chunk(job, heap, from, MIN(from + SCORE_CHUNK, job->count));
+    // polled only when chunks are left, a finished search is kept
+    if (poll && (guint)g_atomic_int_get(&job->next) < job->count
+        && query_cancelled(job->index))
+      g_atomic_int_set(&job->cancelled, TRUE);
+  }
+  g_mutex_lock(&job->lock);
+  for (i = 0; i < heap->len; ++i)
+    push_match(job->index, job->heap, job->limit,
+        g_array_index(heap, match, i).score, g_array_index(heap, match, i).id);
+  g_mutex_unlock(&job->lock);
+  g_array_free(heap, TRUE);
+}
+
+static void score_worker(gpointer data, gpointer user_data)
+{
+  score_job* job = (score_job*)data;
+  score_chunks(job, FALSE);
+  g_mutex_lock(&job->lock);
+  if (!--job->running)
+    g_cond_signal(&job->done);
+  g_mutex_unlock(&job->lock);
+}
+
+static void score_candidates(score_job* job, const guint32* ids,
+    guint count, gint tier)
+{
+  quick_index* index = job->index;
+  guint chunks = (count + SCORE_CHUNK - 1) / SCORE_CHUNK, workers, i;
+  workers = index->score_pool && chunks > 1 ?
+    MIN(chunks, index->threads) - 1 : 0;
+  job->ids = ids;
+  job->count = count;
+  job->tier = tier;
+  job->next = 0;
+  job->running = workers;
+  for (i = 0; i < workers; ++i)
+    g_thread_pool_push(index->score_pool, job, NULL);
+  score_chunks(job, TRUE);
+  g_mutex_lock(&job->lock);
+  while (job->running)
+    g_cond_wait(&job->done, &job->lock);
+  g_mutex_unlock(&job->lock);
+}
+
+// substring matching
+
+static const gram* find_gram(word_index* words, guint32 key)
+{
+  const gram* grams = (const gram*)words->grams->data;
+  guint lo = 0, hi = words->grams->len;
+  while (lo < hi)
+  {
+    guint mid = lo + (hi - lo) / 2;
+    if (grams[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < words->grams->len && grams[lo].key == key ? &grams[lo] : NULL;
+}
+
+// whether the casefolded text contains the casefolded needle, ascii texts
+// are compared in place
+static gboolean text_contains(const gchar* text, const gchar* needle,
+    gsize needle_len)
+{
+  const gchar* p;
+  gchar* folded;
+  gboolean result;
+  gsize i;
+  for (p = text; *p && !(*p & 0x80); ++p)
+    ;
+  if (!*p)
+  {
+    if (needle_len > (gsize)(p - text))
+      return FALSE;
+    for (p = text; *(p + needle_len - 1); ++p)
+    {
+      for (i = 0; i < needle_len && g_ascii_tolower(p[i]) == needle[i]; ++i)
+        ;
+      if (i == needle_len)
+        return TRUE;
+    }
+    return FALSE;
+  }
+  folded = g_utf8_casefold(text, -1);
+  result = strstr(folded, needle) != NULL;
+  g_free(folded);
+  return result;
+}
+
+// The live items whose casefolded text contains the casefolded needle of
+// at least 3 characters: the posting lists of its trigrams are intersected
+// starting with the shortest and the items left are checked.
+static GArray* match_substring(quick_index* index, const gchar* needle)
+{
+  word_index* words = index->words;
+  const guint32* postings = (const guint32*)words->gram_postings->data;
+  GArray* ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+  // pairs of posting list length and trigram
+  GArray* lists = g_array_new(FALSE, FALSE, 2 * sizeof(guint));
+  const gram* first;
+  const gchar* p;
+  gunichar a = 0, b = 0;
+  guint8* found;
+  guint i, j, len, n = 0;
+  for (p = needle; *p; p = g_utf8_next_char(p))
+  {
+    gunichar c = g_utf8_get_char(p);
+    if (++n >= 3)
+    {
+      const gram* g = find_gram(words, gram_key(a, b, c));
+      guint pair[2];
+      if (!g)
+      {
+        g_array_free(lists, TRUE);
+        return ids;
+      }
+      pair[0] = g->count;
+      pair[1] = g - (const gram*)words->grams->data;
+      g_array_append_val(lists, pair);
+    }
+    a = b;
+    b = c;
+  }
+  g_qsort_with_data(lists->data, lists->len, 2 * sizeof(guint),
+      compare_range_size, NULL);
+  first = &g_array_index(words->grams, gram,
+      ((guint*)lists->data)[1]);
+  for (i = 0; i < first->count; ++i)
+    if (!get_item(index, postings[first->postings + i])->dead)
+      g_array_append_val(ids, postings[first->postings + i]);
+  found = g_new(guint8, ids->len);
+  for (i = 1; i < lists->len && ids->len; ++i)
+  {
+    const gram* g = &g_array_index(words->grams, gram,
+        ((guint*)lists->data)[2 * i + 1]);
+    guint32* q = (guint32*)ids->data;
+    memset(found, 0, ids->len);
+    mark_postings(q, ids->len, postings + g->postings, g->count, found);
+    for (j = 0, len = 0; j < ids->len; ++j)
+      if (found[j])
+        q[len++] = q[j];
+    g_array_set_size(ids, len);
+  }
+  // trigrams may be out of order or collide
+  for (i = 0, len = 0; i < ids->len; ++i)
+  {
+    guint32 id = g_array_index(ids, guint32, i);
+    if (text_contains(quick_index_get_text(index, id), needle, strlen(needle)))
+      g_array_index(ids, guint32, len++) = id;
+  }
+  g_array_set_size(ids, len);
+  g_free(found);
+  g_array_free(lists, TRUE);
+  return ids;
+}
+
+GArray* quick_index_query(quick_index* index, const gchar* str,
+    guint group, guint limit, guint* layout, guint* matched)
+{
+  GArray* result = g_array_new(FALSE, FALSE, sizeof(guint));
+  gchar* folded = g_utf8_casefold(str, -1);
+  gchar** words = g_strsplit_set(folded, " \t\v\n\r\f", 0);
+  guint i, j, n = 0;
+  *layout = 0;
+  if (matched)
+    *matched = 0;
+  // the words typed, the range of the last one is kept on the stack
+  for (i = 0; words[i]; ++i)
+    if (*words[i])
+      words[n++] = words[i];
+    else
+      g_free(words[i]);
+  words[n] = NULL;
+  if (n)
+  {
+    const entry* entries = (const entry*)index->words->entries->data;
+    const guint32* postings = (const guint32*)index->words->postings->data;
+    prefix_range** ranges = g_new(prefix_range*, n);
+    prefix_range* r;
+    GArray* heap = g_array_sized_new(FALSE, FALSE, sizeof(match), limit);
+    gunichar query[MAX_TEXT_CHARS];
+    guint qlen = 0;
+    guint64 qmask = 0;
+    score_job job;
+    GArray* ids;
+    gchar* converted = NULL;
+    gchar* needle;
+    for (i = 0; i + 1 < n; ++i)
+      ranges[i] = narrow_range(index->words, NULL, words[i]);
+    r = ranges[n - 1] = find_range(index, words[n - 1]);
+    g_free(words);
+    // the words are typed in one layout, all of them have to be spelled in
+    // the one found
+    *layout = range_layout(index, r);
+    for (i = 0; i + 1 < n && *layout; ++i)
+      if (range_layout(index, ranges[i]) != *layout)
+        *layout = 0;
+    if (*layout)
+      converted = quick_index_convert_layout(index, str, group, *layout - 1);
+    if (converted)
+      str = converted;
+    needle = g_utf8_casefold(str, -1);
+    for (; *str && qlen < MAX_TEXT_CHARS; str = g_utf8_next_char(str))
+    {
+      query[qlen] = g_unichar_tolower(g_utf8_get_char(str));
+      qmask |= char_mask(query[qlen++]);
+    }
+    g_free(converted);
+    ++index->search_stamp;
+    job.index = index;
+    job.query = query;
+    job.qlen = qlen;
+    job.qmask = qmask;
+    job.now = time(NULL);
+    job.limit = limit;
+    job.heap = heap;
+    job.cancelled = FALSE;
+    g_mutex_init(&job.lock);
+    g_cond_init(&job.done);
+    if (n == 1)
+    {
+      ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+      for (i = r->lo; i < r->hi; ++i)
+        if (entries[i].layout == *layout)
+          for (j = 0; j < entries[i].count; ++j)
+            add_candidate(index, ids, postings[entries[i].postings + j]);
+    }
+    else
+    {
+      ids = match_ranges(index, ranges, n, *layout);
+      for (i = 0; i < ids->len; ++i)
+        get_item(index, g_array_index(ids, guint32, i))->stamp =
+          index->search_stamp;
+    }
+    for (i = 0; i + 1 < n; ++i)
+      free_prefix_range(ranges[i]);
+    g_free(ranges);
+    score_candidates(&job, (guint32*)ids->data, ids->len, PREFIX_TIER);
+    g_array_free(ids, TRUE);
+    // substring matches rank below a full heap of word matches
+    if (!job.cancelled && index->substrings && heap->len < limit
+        && g_utf8_strlen(needle, -1) >= 3)
+    {
+      GArray* found = match_substring(index, needle);
+      ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+      for (i = 0; i < found->len; ++i)
+        add_candidate(index, ids, g_array_index(found, guint32, i));
+      g_array_free(found, TRUE);
+      score_candidates(&job, (guint32*)ids->data, ids->len, SUBSTRING_TIER);
+      g_array_free(ids, TRUE);
+    }
+    g_free(needle);
+    if (matched)
+      *matched = heap->len;
+    // neither words nor trigrams find the query as a subsequence, like "jsm"
+    // in John Smith, the items matching it fuzzily fill up the rest
+    if (!job.cancelled && heap->len < limit)
+      score_candidates(&job, NULL, index->num_items, 0);
+    g_mutex_clear(&job.lock);
+    g_cond_clear(&job.done);
+    g_array_sort_with_data(heap, compare_match, index);
+    for (i = 0; i < heap->len; ++i)
+      g_array_append_val(result, g_array_index(heap, match, i).id);
+    g_array_free(heap, TRUE);
+    if (job.cancelled)
+    {
+      g_array_free(result, TRUE);
+      result = NULL;
+    }
+  }
+  else
+    g_strfreev(words);
+  g_free(folded);
+  return result;
+}
+
+// snapshots
+
+// Posting lists refer to items by number, the items being recorded by
+// their identities and texts; at load posting lists are mapped to the
+// items added with the same keys, other items are dropped from them and
+// items missing from the snapshot are built as usual. Alternate spellings
+// depend on the keyboard layouts, a snapshot made with others is ignored,
+// as is one made in the other substring mode.
+
+#define SNAPSHOT_MAGIC 0x58495051
+#define SNAPSHOT_VERSION 4
+
+// followed by the entries, the postings, the trigrams, their postings,
+// the strings and the NUL terminated item keys
+typedef struct _snapshot_header
+{
+  guint32 magic;
+  guint32 version;
+  guint32 stamp;
+  guint32 num_items;
+  guint32 num_entries;
+  guint32 num_postings;
+  guint32 num_grams;
+  guint32 num_gram_postings;
+  guint32 strings_len;
+  guint32 keys_len;
+} snapshot_header;
+
+static guint32 snapshot_stamp(quick_index* index)
+{
+  const guchar* p = (const guchar*)index->layouts->chars;
+  guint32 stamp = 5381;
+  gsize i;
+  for (i = 0; i < sizeof(index->layouts->chars); ++i)
+    stamp = stamp * 33 + p[i];
+  return stamp * 33 + !!index->substrings;
+}
+
+static gchar* item_key(quick_index* index, guint id)
+{
+  item* val = get_item(index, id);
+  gchar* identity;
+  gchar* key;
+  if (!index->funcs.identity)
+    return NULL;
+  identity = index->funcs.identity(id, index->data);
+  if (!identity)
+    return NULL;
+  key = g_strdup_printf("%s\t%.*s", identity,
+      (int)val->text_len, index->texts->str + val->text);
+  g_free(identity);
+  return key;
+}
+
+GString* quick_index_save(quick_index* index)
+{
+  word_index* words = index->words;
+  const entry* entries = (const entry*)words->entries->data;
+  const guint32* postings = (const guint32*)words->postings->data;
+  guint8* indexed = g_new0(guint8, index->num_items);
+  GArray* saved = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+      words->postings->len);
+  GString* data = g_string_new(NULL);
+  GString* keys = g_string_new(NULL);
+  snapshot_header header;
+  guint i, j;
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.stamp = snapshot_stamp(index);
+  header.num_items = index->num_items;
+  header.num_entries = 0;
+  header.strings_len = words->strings->len;
+  g_string_append_len(data, (gchar*)&header, sizeof(header));
+  for (i = 0; i < words->entries->len; ++i)
+  {
+    entry e = entries[i];
+    e.postings = saved->len;
+    for (j = 0; j < entries[i].count; ++j)
+    {
+      guint32 id = postings[entries[i].postings + j];
+      if (!get_item(index, id)->dead)
+      {
+        indexed[id] = 1;
+        g_array_append_val(saved, id);
+      }
+    }
+    e.count = saved->len - e.postings;
+    if (e.count)
+    {
+      g_string_append_len(data, (gchar*)&e, sizeof(entry));
+      ++header.num_entries;
+    }
+  }
+  header.num_postings = saved->len;
+  g_string_append_len(data, saved->data, saved->len * sizeof(guint32));
+  g_array_set_size(saved, 0);
+  header.num_grams = 0;
+  for (i = 0; i < words->grams->len; ++i)
+  {
+    gram g = g_array_index(words->grams, gram, i);
+    g.postings = saved->len;
+    for (j = 0; j < g_array_index(words->grams, gram, i).count; ++j)
+    {
+      guint32 id = g_array_index(words->gram_postings, guint32,
+          g_array_index(words->grams, gram, i).postings + j);
+      if (!get_item(index, id)->dead)
+        g_array_append_val(saved, id);
+    }
+    g.count = saved->len - g.postings;
+    if (g.count)
+    {
+      g_string_append_len(data, (gchar*)&g, sizeof(gram));
+      ++header.num_grams;
+    }
+  }
+  header.num_gram_postings = saved->len;
+  g_string_append_len(data, saved->data, saved->len * sizeof(guint32));
+  // only items whose words are in the index get a key
+  for (i = 0; i < index->num_items; ++i)
+  {
+    gchar* key = indexed[i] ? item_key(index, i) : NULL;
+    if (key)
+      g_string_append(keys, key);
+    g_string_append_c(keys, 0);
+    g_free(key);
+  }
+  header.keys_len = keys->len;
+  memcpy(data->str, &header, sizeof(header));
+  g_string_append_len(data, words->strings->str, words->strings->len);
+  g_string_append_len(data, keys->str, keys->len);
+  g_string_free(keys, TRUE);
+  g_array_free(saved, TRUE);
+  g_free(indexed);
+  return data;
+}
+
+static gboolean snapshot_valid(quick_index* index, const gchar* contents,
+    gsize length)
+{
+  const snapshot_header* header = (const snapshot_header*)contents;
+  const gchar* strings;
+  const gchar* keys;
+  guint32 i, nuls = 0;
+  if (length < sizeof(snapshot_header) || header->magic != SNAPSHOT_MAGIC
+      || header->version != SNAPSHOT_VERSION
+      || header->stamp != snapshot_stamp(index)
+      || length != sizeof(snapshot_header)
+        + (guint64)header->num_entries * sizeof(entry)
+        + (guint64)header->num_postings * sizeof(guint32)
+        + (guint64)header->num_grams * sizeof(gram)
+        + (guint64)header->num_gram_postings * sizeof(guint32)
+        + header->strings_len + header->keys_len)
+    return FALSE;
+  strings = contents + sizeof(snapshot_header)
+    + header->num_entries * sizeof(entry)
+    + header->num_postings * sizeof(guint32)
+    + header->num_grams * sizeof(gram)
+    + header->num_gram_postings * sizeof(guint32);
+  keys = strings + header->strings_len;
+  for (i = 0; i < header->keys_len; ++i)
+    nuls += !keys[i];
+  return nuls == header->num_items
+    && (!header->strings_len || !strings[header->strings_len - 1]);
+}
+
+// Appends the posting list mapped onto the items added, the number of
+// those it has.
+static guint append_mapped(GArray* postings, const guint32* list,
+    guint count, guint num_items, const guint* map, guint8* found)
+{
+  guint start = postings->len, i, n;
+  guint32* p;
+  for (i = 0; i < count; ++i)
+  {
+    guint32 id = list[i];
+    if (id >= num_items || !map[id])
+      continue;
+    id = map[id] - 1;
+    if (found)
+      found[id] = 1;
+    g_array_append_val(postings, id);
+  }
+  if (postings->len == start)
+    return 0;
+  // the ids of the items added now are not in the order they were saved
+  // and items with the same key map to one of them
+  p = (guint32*)postings->data + start;
+  g_qsort_with_data(p, postings->len - start, sizeof(guint32), compare_id,
+      NULL);
+  for (i = 1, n = 1; i < postings->len - start; ++i)
+    if (p[i] != p[n - 1])
+      p[n++] = p[i];
+  g_array_set_size(postings, start + n);
+  return n;
+}
+
+// Maps the snapshot posting lists onto the pending items and leaves
+// pending only the items it has no words of.
+gboolean quick_index_load(quick_index* index, const gchar* contents,
+    gsize length)
+{
+  const snapshot_header* header;
+  const entry* entries;
+  const guint32* postings;
+  const gram* grams;
+  const guint32* gram_postings;
+  const gchar* strings;
+  const gchar* key;
+  GArray* pending = index->pending_items;
+  GHashTable* ids;
+  guint* map;
+  guint8* found;
+  word_index* words;
+  guint i, len = 0;
+  // only the first words are loaded, later ones are built
+  if (index->build_thread || index->words->entries->len
+      || !snapshot_valid(index, contents, length))
+    return FALSE;
+  header = (const snapshot_header*)contents;
+  entries = (const entry*)(contents + sizeof(snapshot_header));
+  postings = (const guint32*)(entries + header->num_entries);
+  grams = (const gram*)(postings + header->num_postings);
+  gram_postings = (const guint32*)(grams + header->num_grams);
+  strings = (const gchar*)(gram_postings + header->num_gram_postings);
+  ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < pending->len; ++i)
+  {
+    guint id = g_array_index(pending, guint, i);
+    gchar* str = item_key(index, id);
+    if (str)
+      g_hash_table_replace(ids, str, GUINT_TO_POINTER(id + 1));
+  }
+  map = g_new(guint, header->num_items);
+  key = strings + header->strings_len;
+  for (i = 0; i < header->num_items; ++i)
+  {
+    map[i] = *key ? GPOINTER_TO_UINT(g_hash_table_lookup(ids, key)) : 0;
+    key += strlen(key) + 1;
+  }
+  g_hash_table_destroy(ids);
+  words = new_word_index(header->num_entries, header->num_postings,
+      header->strings_len);
+  found = g_new0(guint8, index->num_items);
+  g_string_append_len(words->strings, strings, header->strings_len);
+  for (i = 0; i < header->num_entries; ++i)
+  {
+    entry e = entries[i];
+    if ((guint64)e.postings + e.count > header->num_postings
+        || (guint64)e.key + e.key_len >= header->strings_len)
+      continue;
+    e.postings = words->postings->len;
+    e.count = append_mapped(words->postings, postings + entries[i].postings,
+        entries[i].count, header->num_items, map, found);
+    if (e.count)
+      g_array_append_val(words->entries, e);
+  }
+  for (i = 0; i < header->num_grams; ++i)
+  {
+    gram g = grams[i];
+    if ((guint64)g.postings + g.count > header->num_gram_postings)
+      continue;
+    g.postings = words->gram_postings->len;
+    g.count = append_mapped(words->gram_postings,
+        gram_postings + grams[i].postings, grams[i].count, header->num_items,
+        map, NULL);
+    if (g.count)
+      g_array_append_val(words->grams, g);
+  }
+  for (i = 0; i < pending->len; ++i)
+  {
+    guint id = g_array_index(pending, guint, i);
+    if (!found[id])
+      g_array_index(pending, guint, len++) = id;
+  }
+  g_array_set_size(pending, len);
+  words->generation = index->words->generation + 1;
+  free_word_index(index->words);
+  index->words = words;
+  g_free(found);
+  g_free(map);
+  return TRUE;
+}
+
+// messages
+
+// Every word of a message points to it from an inverted index kept up to
+// date as messages are added, query words match word prefixes looked up
+// in the vocabulary, sorted but for a short tail of words added since.
+
+#define MAX_VOCABULARY_TAIL 256
+
+typedef struct _message
+{
+  gboolean dead;
+  guint32 text;
+  guint32 who;
+} message;
+
+struct _quick_messages
+{
+  GArray* messages;
+  GString* texts;
+  // casefolded word -> GArray of the ids of the messages containing it
+  GHashTable* words;
+  // the words sorted for prefix lookups followed by those added since
+  GPtrArray* vocabulary;
+  guint vocabulary_sorted;
+};
+
+static void free_message_postings(gpointer data)
+{
+  g_array_free((GArray*)data, TRUE);
+}
+
+static void init_messages(quick_messages* messages)
+{
+  messages->messages = g_array_new(FALSE, FALSE, sizeof(message));
+  messages->texts = g_string_new(NULL);
+  messages->words = g_hash_table_new_full(g_str_hash, g_str_equal,
+      g_free, free_message_postings);
+  messages->vocabulary = g_ptr_array_new();
+  messages->vocabulary_sorted = 0;
+}
+
+static void clear_messages(quick_messages* messages)
+{
+  g_array_free(messages->messages, TRUE);
+  g_string_free(messages->texts, TRUE);
+  g_hash_table_destroy(messages->words);
+  g_ptr_array_free(messages->vocabulary, TRUE);
+}
+
+quick_messages* quick_messages_new()
+{
+  quick_messages* messages = g_new0(quick_messages, 1);
+  init_messages(messages);
+  return messages;
+}
+
+void quick_messages_free(quick_messages* messages)
+{
+  clear_messages(messages);
+  g_free(messages);
+}
+
+// the casefolded runs of letters and digits of a text
+static GPtrArray* split_message_words(const gchar* text)
+{
+  GPtrArray* words = g_ptr_array_new_with_free_func(g_free);
+  const gchar* start = NULL;
+  const gchar* p;
+  for (p = text; ; p = g_utf8_next_char(p))
+  {
+    gboolean alnum = *p && g_unichar_isalnum(g_utf8_get_char(p));
+    if (alnum && !start)
+      start = p;
+    else if (!alnum && start)
+    {
+      g_ptr_array_add(words, g_utf8_casefold(start, p - start));
+      start = NULL;
+    }
+    if (!*p)
+      break;
+  }
+  return words;
+}
+
+static gint compare_message_word(gconstpointer a, gconstpointer b,
+    gpointer data)
+{
+  return strcmp(*(gchar**)a, *(gchar**)b);
+}
+
+static void merge_vocabulary(quick_messages* messages)
+{
+  gchar** words = (gchar**)messages->vocabulary->pdata;
+  guint len = messages->vocabulary->len, sorted = messages->vocabulary_sorted;
+  guint i = 0, j = sorted, k = 0;
+  gchar** merged = g_new(gchar*, len);
+  g_qsort_with_data(words + j, len - j, sizeof(gchar*), compare_message_word,
+      NULL);
+  while (i < sorted || j < len)
+    merged[k++] = j == len || (i < sorted && strcmp(words[i], words[j]) < 0)
+      ? words[i++] : words[j++];
+  memcpy(words, merged, len * sizeof(gchar*));
+  g_free(merged);
+  messages->vocabulary_sorted = len;
+}
+
+guint quick_messages_add(quick_messages* messages, const gchar* who,
+    const gchar* text)
+{
+  GPtrArray* words = split_message_words(text);
+  guint i, id = messages->messages->len;
+  message msg = {FALSE, 0, 0};
+  msg.text = append_string(messages->texts, text, strlen(text));
+  msg.who = append_string(messages->texts, who, strlen(who));
+  g_array_append_val(messages->messages, msg);
+  for (i = 0; i < words->len; ++i)
+  {
+    GArray* ids = (GArray*)g_hash_table_lookup(messages->words,
+        words->pdata[i]);
+    if (!ids)
+    {
+      gchar* word = g_strdup((gchar*)words->pdata[i]);
+      ids = g_array_new(FALSE, FALSE, sizeof(guint));
+      g_hash_table_insert(messages->words, word, ids);
+      g_ptr_array_add(messages->vocabulary, word);
+    }
+    // a word repeated in a message is recorded once
+    if (!ids->len || g_array_index(ids, guint, ids->len - 1) != id)
+      g_array_append_val(ids, id);
+  }
+  g_ptr_array_free(words, TRUE);
+  return id;
+}
+
+void quick_messages_remove(quick_messages* messages, guint id)
+{
+  g_array_index(messages->messages, message, id).dead = TRUE;
+}
+
+const gchar* quick_messages_get_text(quick_messages* messages, guint id)
+{
+  return messages->texts->str
+    + g_array_index(messages->messages, message, id).text;
+}
+
+const gchar* quick_messages_get_who(quick_messages* messages, guint id)
+{
+  return messages->texts->str
+    + g_array_index(messages->messages, message, id).who;
+}
+
+void quick_messages_compact(quick_messages* messages)
+{
+  quick_messages old = *messages;
+  guint i;
+  init_messages(messages);
+  for (i = 0; i < old.messages->len; ++i)
+  {
+    message* msg = &g_array_index(old.messages, message, i);
+    if (!msg->dead)
+      quick_messages_add(messages, old.texts->str + msg->who,
+          old.texts->str + msg->text);
+  }
+  merge_vocabulary(messages);
+  clear_messages(&old);
+}
+
+static void mark_messages(quick_messages* messages, guint64* bits,
+    const gchar* word)
+{
+  GArray* ids = (GArray*)g_hash_table_lookup(messages->words, word);
+  guint i;
+  for (i = 0; i < ids->len; ++i)
+  {
+    guint id = g_array_index(ids, guint, i);
+    bits[id / 64] |= (guint64)1 << (id % 64);
+  }
+}
+
+// a bit for every message having a word starting with the prefix
+static guint64* match_messages(quick_messages* messages, const gchar* prefix)
+{
+  guint64* bits = g_new0(guint64, (messages->messages->len + 63) / 64);
+  gchar** words;
+  gsize len = strlen(prefix);
+  guint lo = 0, hi, i;
+  if (messages->vocabulary->len - messages->vocabulary_sorted
+      > MAX_VOCABULARY_TAIL)
+    merge_vocabulary(messages);
+  words = (gchar**)messages->vocabulary->pdata;
+  hi = messages->vocabulary_sorted;
+  while (lo < hi)
+  {
+    guint mid = lo + (hi - lo) / 2;
+    if (strcmp(words[mid], prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (i = lo; i < messages->vocabulary_sorted
+      && !strncmp(words[i], prefix, len); ++i)
+    mark_messages(messages, bits, words[i]);
+  for (i = messages->vocabulary_sorted; i < messages->vocabulary->len; ++i)
+    if (!strncmp(words[i], prefix, len))
+      mark_messages(messages, bits, words[i]);
+  return bits;
+}
+
+GArray* quick_messages_query(quick_messages* messages, const gchar* query,
+    guint limit)
+{
+  GArray* result = g_array_new(FALSE, FALSE, sizeof(guint));
+  GPtrArray* words = split_message_words(query);
+  guint64* bits = NULL;
+  guint i, j, len = (messages->messages->len + 63) / 64;
+  for (i = 0; i < words->len; ++i)
+  {
+    guint64* word_bits = match_messages(messages, (gchar*)words->pdata[i]);
+    if (bits)
+    {
+      for (j = 0; j < len; ++j)
+        bits[j] &= word_bits[j];
+      g_free(word_bits);
+    }
+    else
+      bits = word_bits;
+  }
+  for (i = messages->messages->len; bits && i-- > 0 && result->len < limit; )
+    if (bits[i / 64] & ((guint64)1 << (i % 64))
+        && !g_array_index(messages->messages, message, i).dead)
+      g_array_append_val(result, i);
+  g_free(bits);
+  g_ptr_array_free(words, TRUE);
+  return result;
+}
@@ -0,0 +1,138 @@
+#ifndef QUICKINDEX_H
+#define QUICKINDEX_H
+
+#include <glib.h>
+
+// The matching engine of the quick window. Items are texts found by the
+// prefixes of their words, by those prefixes typed in the wrong keyboard
+// layout and fuzzily by subsequence, ranked by match quality and a bonus
+// supplied by the user, and the messages of conversations found by the
+// prefixes of their words. It depends on GLib only: words of items are
+// indexed on a worker thread and handed over to the default main context,
+// everything else is to be called from the thread running it.
+
+#define QUICK_INDEX_GROUPS 4
+#define QUICK_INDEX_KEYCODES 256
+// the number of results the quick window asks for at a time
+#define QUICK_INDEX_PAGE 32
+
+typedef struct _quick_index quick_index;
+typedef struct _quick_layouts quick_layouts;
+
+typedef struct _quick_index_funcs
+{
+  // an extra score of the item, called from the thread running a query
+  // and from the scoring workers at the same time while it waits for them
+  gint (*bonus)(guint id, gint64 now, gpointer data);
+  // an identity of the item stable across restarts, NULL if it has none;
+  // only items having one are kept in saved snapshots
+  gchar* (*identity)(guint id, gpointer data);
+  // a new snapshot of the words has been swapped in
+  void (*built)(quick_index* index, gpointer data);
+  // polled by the thread running a query between chunks of candidates
+  // while some are left, TRUE abandons it
+  gboolean (*cancelled)(gpointer data);
+} quick_index_funcs;
+
+typedef struct _quick_index_stats
+{
+  guint items;
+  // distinct words and their item ids
+  guint words;
+  gsize words_size;
+  guint postings;
+  gsize postings_size;
+  // trigrams and their item ids
+  guint grams;
+  gsize grams_size;
+  gsize strings_size;
+  gsize items_size;
+  gsize texts_size;
+  gsize masks_size;
+} quick_index_stats;
+
+// Keyboard layouts: the character of every key in every group, to spell
+// words as typed in another layout.
+quick_layouts* quick_layouts_new();
+void quick_layouts_add_key(quick_layouts* layouts, guint group,
+    guint keycode, guint level, gunichar c);
+void quick_layouts_free(quick_layouts* layouts);
+
+// funcs may be NULL as may be any of them
+quick_index* quick_index_new(const quick_index_funcs* funcs, gpointer data);
+void quick_index_free(quick_index* index);
+
+// Takes ownership of the layouts, the words of all items are built again
+// with them.
+void quick_index_set_layouts(quick_index* index, quick_layouts* layouts);
+// Substring mode indexes the trigrams of the items as well so queries are
+// found anywhere in their texts, at the cost of about 4 bytes per
+// character of text. The words of all items are built again.
+void quick_index_set_substrings(quick_index* index, gboolean substrings);
+// Queries matching many items are scored by this many threads, the one
+// running them and a pool of workers kept until the next call, 1 by default.
+void quick_index_set_threads(quick_index* index, guint threads);
+// the text typed with the same keys in another group, NULL if some of its
+// characters have no key in either
+gchar* quick_index_convert_layout(quick_index* index, const gchar* str,
+    guint from, guint to);
+
+// Items are numbered, ids of removed items are reused. Items added are
+// found by prefix once their words are built shortly after, fuzzily at
+// once. A NULL text makes an item which is never found.
+guint quick_index_add(quick_index* index, const gchar* text);
+void quick_index_remove(quick_index* index, guint id);
+// While ids are held those of removed items are not reused, so ids handed
+// out stay those of the removed items rather than of new ones.
+void quick_index_hold_ids(quick_index* index, gboolean hold);
+// the new id of the item
+guint quick_index_update(quick_index* index, guint id, const gchar* text);
+const gchar* quick_index_get_text(quick_index* index, guint id);
+
+// Starts building the words of the items added without waiting for more.
+void quick_index_build(quick_index* index);
+// whether a build is scheduled or running
+gboolean quick_index_building(quick_index* index);
+
+// The ids of the best limit items matching the query typed in the group,
+// best first. Items having words starting with each space separated word
+// of the query rank first, then in substring mode items containing the
+// query of at least 3 characters, the rest of the limit is filled up with
+// items matching it fuzzily, like "jsm" matches John Smith. Layout
+// is set to the group the query was converted to + 1 when only the
+// spellings typed in another layout matched, 0 otherwise. Matched, unless
+// NULL, is set to the number of results found by words or substrings,
+// which come before the fuzzy ones. NULL if the query has been cancelled.
+GArray* quick_index_query(quick_index* index, const gchar* query,
+    guint group, guint limit, guint* layout, guint* matched);
+
+// Snapshots of the words of the items having an identity, loading one
+// maps its words onto the items added with the same identities and texts
+// so they need not be built. Snapshots made with other layouts or in the
+// other substring mode are rejected.
+GString* quick_index_save(quick_index* index);
+gboolean quick_index_load(quick_index* index, const gchar* contents,
+    gsize length);
+
+void quick_index_get_stats(quick_index* index, quick_index_stats* stats);
+
+// Messages: texts found by the prefixes of all their words, newest first.
+// Ids are given in the order messages are added.
+typedef struct _quick_messages quick_messages;
+
+quick_messages* quick_messages_new();
+void quick_messages_free(quick_messages* messages);
+guint quick_messages_add(quick_messages* messages, const gchar* who,
+    const gchar* text);
+void quick_messages_remove(quick_messages* messages, guint id);
+const gchar* quick_messages_get_text(quick_messages* messages, guint id);
+const gchar* quick_messages_get_who(quick_messages* messages, guint id);
+// Drops the removed messages, the others keep their order and are
+// numbered again from 0.
+void quick_messages_compact(quick_messages* messages);
+// the ids of the newest limit messages having words starting with every
+// word of the query
+GArray* quick_messages_query(quick_messages* messages, const gchar* query,
+    guint limit);
+
+#endif
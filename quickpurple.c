@@ -17,10 +17,18 @@
 #include <conversation.h>
 #include <gtkhotkey.h>
 #include <util.h>
+#include <debug.h>
 #include <gtkplugin.h>
 #include <core.h>
 #include <gtkaccount.h>
 #include <gtkprefs.h>
+#include <math.h>
+#include <stdio.h>
+#include "quickindex.h"
+
+#define PREF_ROOT "/plugins/gtk/quickpurple"
+#define HOTKEY_PREF PREF_ROOT "/hotkey"
+#define SUBSTRINGS_PREF PREF_ROOT "/substrings"
 
 // index
 
@@ -42,19 +50,34 @@ typedef struct _action
   char* stock;
 } action;
 
+typedef struct _usage_stat
+{
+  guint count;
+  gint64 last;
+  gdouble score;
+} usage_stat;
+
 typedef struct _item
 {
-  uint refs;
   enum item_type type;
   PurpleStatusPrimitive primitive;
   gpointer data;
+  gboolean dead;
+  // the id + 1 of a message found by a search in the message index
+  guint message;
+  usage_stat* usage;
 } item;
 
-typedef struct _pair
-{
-  gchar* key;
-  item* value;
-} pair;
+// Items are numbered by the index and live in fixed size blocks so
+// pointers to them handed out to the ui stay valid while they grow. Ids
+// of removed items are held while the window is shown so no row of a
+// dead item turns into another one.
+#define ITEM_BLOCK_SIZE 1024
+// results are fetched a page at a time as the list is scrolled, the
+// window shows about a dozen
+#define RESULTS_PAGE QUICK_INDEX_PAGE
+// the threads scoring a search matching many items at most
+#define MAX_SEARCH_THREADS 4
 
 static void quit_pidgin()
 {
@@ -77,217 +100,686 @@ static action actions[] =
 
 static const gint num_actions = G_N_ELEMENTS(actions);
 
-typedef struct _transformation
-{
-  uint group;
-  gchar* str;
-} transformation;
+// The index is given the keyboard layouts read from the keymap, again when
+// it changes. The locked group is tracked from key events so converting a
+// query makes no X requests.
+
+static uint current_group = 0;
 
-static GSList* transform(const gchar* str)
+static quick_layouts* read_layouts()
 {
-  uint i, pos = 0;
-  uint slen = g_utf8_strlen(str, -1);
-  uint* codes = g_newa(uint, XkbNumKbdGroups * slen);
-  GSList* result = NULL;
+  GdkKeymap* keymap = gdk_keymap_get_default();
+  quick_layouts* layouts = quick_layouts_new();
   XkbStateRec state;
-  XkbGetState(gdk_x11_get_default_xdisplay(), XkbUseCoreKbd, &state);
-  memset(codes, 0, XkbNumKbdGroups * slen * sizeof(uint));
-  for ( ; *str; str = g_utf8_next_char(str))
+  guint keycode;
+  for (keycode = 0; keycode < QUICK_INDEX_KEYCODES; ++keycode)
   {
     GdkKeymapKey* keys;
     guint* keyvals;
-    guint nkeys;
-    guint keycode = 0;
-    if (gdk_keymap_get_entries_for_keyval(NULL,
-          gdk_unicode_to_keyval(g_utf8_get_char(str)), &keys, &nkeys))
+    gint nkeys, i;
+    if (!gdk_keymap_get_entries_for_keycode(keymap, keycode,
+          &keys, &keyvals, &nkeys))
+      continue;
+    for (i = 0; i < nkeys; i++)
+      if (keys[i].group >= 0)
+        quick_layouts_add_key(layouts, keys[i].group, keycode, keys[i].level,
+            gdk_keyval_to_unicode(keyvals[i]));
+    g_free(keys);
+    g_free(keyvals);
+  }
+  XkbGetState(gdk_x11_get_default_xdisplay(), XkbUseCoreKbd, &state);
+  current_group = state.locked_group;
+  return layouts;
+}
+
+// The index lives as long as the plugin is loaded and is kept up to date
+// by purple signals, items having an identity are looked up by their data.
+
+static quick_index* item_index = NULL;
+static GHashTable* quick_items = NULL;
+static GPtrArray* item_blocks = NULL;
+static GHashTable* dirty_contacts = NULL;
+static guint dirty_timeout = 0;
+
+static item* get_block_item(GPtrArray* blocks, guint id)
+{
+  item* block = (item*)g_ptr_array_index(blocks, id / ITEM_BLOCK_SIZE);
+  return &block[id % ITEM_BLOCK_SIZE];
+}
+
+// a cleared item, the blocks grown to hold it
+static item* new_block_item(GPtrArray* blocks, guint id)
+{
+  item* val;
+  while (blocks->len * ITEM_BLOCK_SIZE <= id)
+    g_ptr_array_add(blocks, g_new(item, ITEM_BLOCK_SIZE));
+  val = get_block_item(blocks, id);
+  memset(val, 0, sizeof(item));
+  return val;
+}
+
+static item* get_item(guint id)
+{
+  return get_block_item(item_blocks, id);
+}
+
+static item* new_item(enum item_type type, gpointer data, const gchar* text)
+{
+  guint id = quick_index_add(item_index, text);
+  item* val = new_block_item(item_blocks, id);
+  val->type = type;
+  val->data = data;
+  if (data)
+    g_hash_table_insert(quick_items, data, GUINT_TO_POINTER(id + 1));
+  return val;
+}
+
+static void forget_item(gpointer data)
+{
+  guint id = GPOINTER_TO_UINT(g_hash_table_lookup(quick_items, data));
+  if (id--)
+  {
+    g_hash_table_remove(quick_items, data);
+    get_item(id)->dead = TRUE;
+    quick_index_remove(item_index, id);
+  }
+}
+
+// usage statistics
+
+// Activations are remembered per contact, chat or status identity and
+// blended into the ranking as a score decaying with the given half life.
+// Statistics are written out in batches some time after activations.
+
+#define USAGE_FILE "quickpurple-usage"
+#define USAGE_HALF_LIFE (7 * 24 * 60 * 60)
+#define USAGE_WEIGHT 16
+#define USAGE_SAVE_DELAY 10
+
+static GHashTable* usage_stats = NULL;
+static guint usage_timeout = 0;
+
+// The least of the identities of the buddies of a contact, which unlike
+// its priority buddy does not change with their presence.
+static gchar* contact_identity(PurpleContact* contact)
+{
+  PurpleBlistNode* node;
+  gchar* result = NULL;
+  for (node = ((PurpleBlistNode*)contact)->child; node; node = node->next)
+    if (node->type == PURPLE_BLIST_BUDDY_NODE)
     {
-      for (i = 0; i < nkeys; i++)
-        if (keys[i].group == state.locked_group)
-        {
-          keycode = keys[i].keycode;
-          break;
-        }
-      g_free(keys);
-      if (keycode && gdk_keymap_get_entries_for_keycode(NULL, keycode,
-            &keys, &keyvals, &nkeys))
+      PurpleAccount* account = purple_buddy_get_account((PurpleBuddy*)node);
+      gchar* identity = g_strdup_printf("contact\t%s\t%s\t%s",
+          purple_account_get_protocol_id(account),
+          purple_account_get_username(account),
+          purple_buddy_get_name((PurpleBuddy*)node));
+      if (!result || strcmp(identity, result) < 0)
       {
-        for (i = 0; i < nkeys; i++)
-          if (keys[i].group != state.locked_group
-              && keys[i].level == 0 && keys[i].group < XkbNumKbdGroups)
-            codes[keys[i].group * slen + pos] = gdk_keyval_to_unicode(keyvals[i]);
-        g_free(keys);
-        g_free(keyvals);
+        g_free(result);
+        result = identity;
       }
+      else
+        g_free(identity);
     }
-    if (!keycode)
-      return NULL;
-    pos++;
+  return result;
+}
+
+static gchar* item_identity(item* val)
+{
+  PurpleAccount* account;
+  PurpleStatus* status;
+  switch(val->type)
+  {
+    case CONTACT:
+      return contact_identity((PurpleContact*)val->data);
+    case CHAT:
+      account = purple_chat_get_account((PurpleChat*)val->data);
+      return g_strdup_printf("chat\t%s\t%s\t%s",
+          purple_account_get_protocol_id(account),
+          purple_account_get_username(account),
+          purple_chat_get_name((PurpleChat*)val->data));
+    case STATUS:
+      status = (PurpleStatus*)val->data;
+      account = purple_presence_get_account(purple_status_get_presence(status));
+      return g_strdup_printf("status\t%s\t%s\t%s",
+          purple_account_get_protocol_id(account),
+          purple_account_get_username(account),
+          purple_status_get_id(status));
+    case STATUS_PRIMITIVE:
+      return g_strdup_printf("primitive\t%s",
+          purple_primitive_get_id_from_type(val->primitive));
+    case STATUS_SAVED:
+      return g_strdup_printf("saved\t%ld", (long)purple_savedstatus_get_creation_time(
+            (PurpleSavedStatus*)val->data));
+    case ACTION:
+      return g_strdup_printf("action\t%s", ((action*)val->data)->name);
+    case MESSAGE:
+      break;
+  }
+  return NULL;
+}
+
+static gdouble usage_score(usage_stat* stat, gint64 now)
+{
+  return stat->score * pow(2, -(gdouble)(now - stat->last) / USAGE_HALF_LIFE);
+}
+
+static gint usage_bonus(item* val, gint64 now)
+{
+  if (!val->usage)
+    return 0;
+  return (gint)(USAGE_WEIGHT * log2(1 + usage_score(val->usage, now)));
+}
+
+static void load_usage()
+{
+  gchar* filename = g_build_filename(purple_user_dir(), USAGE_FILE, NULL);
+  gchar* contents;
+  usage_stats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  if (g_file_get_contents(filename, &contents, NULL, NULL))
+  {
+    gchar** lines = g_strsplit(contents, "\n", 0);
+    int i;
+    for (i = 0; lines[i]; ++i)
+    {
+      usage_stat stat;
+      usage_stat* copy;
+      long last;
+      int pos = 0;
+      if (sscanf(lines[i], "%u %ld %lf %n", &stat.count, &last, &stat.score, &pos) >= 3
+          && pos && lines[i][pos])
+      {
+        stat.last = last;
+        copy = g_new(usage_stat, 1);
+        *copy = stat;
+        g_hash_table_replace(usage_stats, g_strdup(lines[i] + pos), copy);
+      }
+    }
+    g_strfreev(lines);
+    g_free(contents);
   }
-  for (i = 0; i < XkbNumKbdGroups; i++)
+  g_free(filename);
+}
+
+static void save_usage()
+{
+  GString* data = g_string_new(NULL);
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, usage_stats);
+  while (g_hash_table_iter_next(&iter, &key, &value))
   {
-    long read;
-    gchar* str = g_ucs4_to_utf8(&codes[i * slen], slen, &read, NULL, NULL);
-    if (read == slen)
+    usage_stat* stat = (usage_stat*)value;
+    g_string_append_printf(data, "%u %ld %g %s\n",
+        stat->count, (long)stat->last, stat->score, (gchar*)key);
+  }
+  purple_util_write_data_to_file(USAGE_FILE, data->str, data->len);
+  g_string_free(data, TRUE);
+}
+
+static gboolean on_usage_timeout(gpointer data)
+{
+  save_usage();
+  usage_timeout = 0;
+  return FALSE;
+}
+
+static void record_usage(item* val)
+{
+  gint64 now = time(NULL);
+  if (!val->usage)
+  {
+    gchar* identity = item_identity(val);
+    if (!identity)
+      return;
+    val->usage = (usage_stat*)g_hash_table_lookup(usage_stats, identity);
+    if (!val->usage)
     {
-      transformation* tr = g_new(transformation, 1);
-      tr->group = i;
-      tr->str = str;
-      result = g_slist_append(result, tr);
+      val->usage = g_new0(usage_stat, 1);
+      g_hash_table_insert(usage_stats, identity, val->usage);
     }
     else
-      g_free(str);
+      g_free(identity);
   }
-  return result;
+  val->usage->score = usage_score(val->usage, now) + 1;
+  val->usage->last = now;
+  ++val->usage->count;
+  if (!usage_timeout)
+    usage_timeout = purple_timeout_add_seconds(USAGE_SAVE_DELAY,
+        on_usage_timeout, NULL);
+}
+
+static void destroy_usage()
+{
+  if (usage_timeout)
+  {
+    purple_timeout_remove(usage_timeout);
+    usage_timeout = 0;
+    save_usage();
+  }
+  g_hash_table_destroy(usage_stats);
+  usage_stats = NULL;
+}
+
+
+// index snapshot
+
+// The index is saved some time after it changed and loaded at startup so
+// the first queries do not wait for the words of the whole buddy list to
+// be built.
+
+#define SNAPSHOT_FILE "quickpurple-index"
+#define SNAPSHOT_SAVE_DELAY 30
+
+static guint snapshot_timeout = 0;
+static gboolean quitting = FALSE;
+
+static void save_snapshot()
+{
+  GString* data = quick_index_save(item_index);
+  purple_util_write_data_to_file(SNAPSHOT_FILE, data->str, data->len);
+  g_string_free(data, TRUE);
 }
 
-static void on_destroy_pair(gpointer data)
+static gboolean on_snapshot_timeout(gpointer data)
 {
-  pair* p = (pair*)data;
-  g_free(p->key);
-  if (--p->value->refs == 0)
-    g_free(p->value);
-  g_free(p);
+  save_snapshot();
+  snapshot_timeout = 0;
+  return FALSE;
 }
 
-static gint compare_pair(gconstpointer a, gconstpointer b, gpointer cookie)
+static void schedule_snapshot()
 {
-  return g_utf8_collate(((pair*)a)->key, ((pair*)b)->key);
+  if (!snapshot_timeout && !quitting)
+    snapshot_timeout = purple_timeout_add_seconds(SNAPSHOT_SAVE_DELAY,
+        on_snapshot_timeout, NULL);
 }
 
-static void append_item(GSequence* index, const gchar* name, item* item)
+static void flush_snapshot()
 {
-  int i;
-  gchar** parts = g_strsplit_set(name, " \t\v\n\r\f", 0);
-  for(i = 0; parts[i]; ++i)
+  if (snapshot_timeout)
   {
-    pair* p = g_new(pair, 1);
-    p->key = g_utf8_casefold(parts[i], -1);
-    p->value = item;
-    ++item->refs;
-    g_sequence_append(index, p);
+    purple_timeout_remove(snapshot_timeout);
+    snapshot_timeout = 0;
+    save_snapshot();
   }
-  g_strfreev(parts);
 }
 
-static GSequence* create_index()
+// items refer to purple objects which are gone by the time plugins are
+// unloaded on exit
+static void on_quitting(gpointer data)
+{
+  flush_snapshot();
+  quitting = TRUE;
+}
+
+static void load_snapshot()
+{
+  gchar* filename = g_build_filename(purple_user_dir(), SNAPSHOT_FILE, NULL);
+  GMappedFile* file = g_mapped_file_new(filename, FALSE, NULL);
+  g_free(filename);
+  if (!file)
+    return;
+  quick_index_load(item_index, g_mapped_file_get_contents(file),
+      g_mapped_file_get_length(file));
+  g_mapped_file_unref(file);
+}
+
+// index
+
+static gint get_item_bonus(guint id, gint64 now, gpointer data)
+{
+  return usage_bonus(get_item(id), now);
+}
+
+static gchar* get_item_identity(guint id, gpointer data)
+{
+  return item_identity(get_item(id));
+}
+
+static void log_index_memory()
+{
+  quick_index_stats stats;
+  gsize items_size = item_blocks->len * ITEM_BLOCK_SIZE * sizeof(item);
+  quick_index_get_stats(item_index, &stats);
+  purple_debug_info("quickpurple", "index of %u items in %u KiB: "
+      "%u words %u KiB, %u postings %u KiB, %u trigrams %u KiB, "
+      "strings %u KiB, items %u KiB, texts %u KiB, masks %u KiB\n",
+      stats.items, (guint)((stats.words_size + stats.postings_size
+          + stats.grams_size + stats.strings_size + stats.items_size
+          + items_size + stats.texts_size + stats.masks_size) / 1024),
+      stats.words, (guint)(stats.words_size / 1024),
+      stats.postings, (guint)(stats.postings_size / 1024),
+      stats.grams, (guint)(stats.grams_size / 1024),
+      (guint)(stats.strings_size / 1024),
+      (guint)((stats.items_size + items_size) / 1024),
+      (guint)(stats.texts_size / 1024), (guint)(stats.masks_size / 1024));
+}
+
+static void on_index_built(quick_index* index, gpointer data)
+{
+  log_index_memory();
+  schedule_snapshot();
+}
+
+static Bool find_key_press(Display* display, XEvent* event, XPointer found)
+{
+  if (event->type == KeyPress)
+    *(gboolean*)found = TRUE;
+  // nothing is taken off the queue
+  return False;
+}
+
+// A key pressed during a search, most likely the next keystroke, makes its
+// results stale: it is abandoned and runs again once the key has been
+// handled. The whole X queue is scanned, then the events GDK has taken off
+// it already, which are put back in order with nothing else lost.
+static gboolean is_search_cancelled(gpointer data)
+{
+  gboolean found = FALSE;
+  GQueue* queued;
+  GdkEvent* next;
+  XEvent event;
+  XCheckIfEvent(gdk_x11_get_default_xdisplay(), &event, find_key_press,
+      (XPointer)&found);
+  if (found)
+    return TRUE;
+  queued = g_queue_new();
+  while ((next = gdk_event_get()))
+  {
+    found = found || next->type == GDK_KEY_PRESS;
+    g_queue_push_tail(queued, next);
+  }
+  while ((next = (GdkEvent*)g_queue_pop_head(queued)))
+  {
+    gdk_event_put(next);
+    gdk_event_free(next);
+  }
+  g_queue_free(queued);
+  return found;
+}
+
+static const quick_index_funcs index_funcs =
+{
+  get_item_bonus,
+  get_item_identity,
+  on_index_built,
+  is_search_cancelled
+};
+
+static void find_usage(item* val)
+{
+  gchar* identity = item_identity(val);
+  if (identity)
+  {
+    val->usage = (usage_stat*)g_hash_table_lookup(usage_stats, identity);
+    g_free(identity);
+  }
+}
+
+static void index_node(PurpleBlistNode* node)
+{
+  switch(node->type)
+  {
+  case PURPLE_BLIST_CONTACT_NODE:
+    find_usage(new_item(CONTACT, node,
+          purple_contact_get_alias((PurpleContact*)node)));
+    break;
+  case PURPLE_BLIST_CHAT_NODE:
+    find_usage(new_item(CHAT, node, ((PurpleChat*)node)->alias));
+    break;
+  default:
+    break;
+  }
+}
+
+static void index_saved_status(PurpleSavedStatus* sst)
+{
+  if (!purple_savedstatus_is_transient(sst) ||
+      purple_savedstatus_get_message(sst))
+    find_usage(new_item(STATUS_SAVED, sst, purple_savedstatus_get_title(sst)));
+}
+
+static void index_account(PurpleAccount* acct)
+{
+  PurplePresence* pr = purple_account_get_presence(acct);
+  GList* stl = purple_presence_get_statuses(pr);
+  for(; stl; stl = stl->next)
+  {
+    PurpleStatus* st = (PurpleStatus*)stl->data;
+    gchar* text = g_strdup_printf("%s %s %s",
+        purple_account_get_username(acct),
+        purple_account_get_protocol_name(acct),
+        purple_status_get_name(st));
+    find_usage(new_item(STATUS, st, text));
+    g_free(text);
+  }
+}
+
+static void forget_account(PurpleAccount* acct)
+{
+  PurplePresence* pr = purple_account_get_presence(acct);
+  GList* stl = purple_presence_get_statuses(pr);
+  for(; stl; stl = stl->next)
+    forget_item(stl->data);
+}
+
+static void create_index()
 {
   GList* statuses;
   GList* accounts;
   GList* cur;
   PurpleBlistNode* node;
   int i;
-  GSequence* result = g_sequence_new(on_destroy_pair);
+  item_index = quick_index_new(&index_funcs, NULL);
+  quick_index_set_layouts(item_index, read_layouts());
+  quick_index_set_substrings(item_index,
+      purple_prefs_get_bool(SUBSTRINGS_PREF));
+  quick_index_set_threads(item_index,
+      MIN(g_get_num_processors(), MAX_SEARCH_THREADS));
+  quick_items = g_hash_table_new(g_direct_hash, g_direct_equal);
+  item_blocks = g_ptr_array_new_with_free_func(g_free);
+  dirty_contacts = g_hash_table_new(g_direct_hash, g_direct_equal);
   for(node = purple_blist_get_root(); node; node = purple_blist_node_next(node, TRUE))
-  {
-    const gchar* alias;
-    item *val = g_new0(item, 1);
-    val->data = node;
-    switch(node->type)
-    {
-    case PURPLE_BLIST_CONTACT_NODE:
-      alias = purple_contact_get_alias((PurpleContact*)node);
-      val->type = CONTACT;
-      break;
-    case PURPLE_BLIST_CHAT_NODE:
-      alias = ((PurpleChat*)node)->alias;
-      val->type = CHAT;
-      break;
-    default:
-      continue;
-    }
-    append_item(result, alias, val);
-  }
+    index_node(node);
   for (statuses = purple_savedstatuses_get_all(); statuses; statuses = statuses->next)
-  {
-    PurpleSavedStatus* sst = (PurpleSavedStatus*)statuses->data;
-    if (!purple_savedstatus_is_transient(sst) ||
-        purple_savedstatus_get_message(sst))
-    {
-      item *val = g_new0(item, 1);
-      val->type = STATUS_SAVED;
-      val->data = sst;
-      append_item(result, purple_savedstatus_get_title(sst), val);
-    }
-  }
+    index_saved_status((PurpleSavedStatus*)statuses->data);
   for (i = 1; i < PURPLE_STATUS_NUM_PRIMITIVES; ++i)
   {
-    item *val = g_new0(item, 1);
-    val->type = STATUS_PRIMITIVE;
+    gchar* text = g_strdup_printf("%s %s",
+        purple_primitive_get_id_from_type(i),
+        purple_primitive_get_name_from_type(i));
+    item* val = new_item(STATUS_PRIMITIVE, NULL, text);
     val->primitive = i;
-    append_item(result, purple_primitive_get_id_from_type(i), val);
-    append_item(result, purple_primitive_get_name_from_type(i), val);
+    find_usage(val);
+    g_free(text);
   }
   accounts = purple_accounts_get_all_active();
   for (cur = accounts; cur; cur = cur->next)
-  {
-    PurpleAccount* acct = (PurpleAccount*)cur->data;
-    PurplePresence* pr = purple_account_get_presence(acct);
-    GList* stl = purple_presence_get_statuses(pr);
-    for(; stl; stl = stl->next)
-    {
-      PurpleStatus* st = (PurpleStatus*)stl->data;
-      item *val = g_new0(item, 1);
-      val->type = STATUS;
-      val->data = st;
-      append_item(result, purple_account_get_username(acct), val);
-      append_item(result, purple_account_get_protocol_name(acct), val);
-      append_item(result, purple_status_get_name(st), val);
-    }
-  }
+    index_account((PurpleAccount*)cur->data);
   g_list_free(accounts);
   for (i = 0; i < num_actions; ++i)
+    find_usage(new_item(ACTION, &actions[i], actions[i].name));
+  load_snapshot();
+  quick_index_build(item_index);
+}
+
+// index maintenance
+
+static void reindex_node(PurpleBlistNode* node)
+{
+  forget_item(node);
+  index_node(node);
+}
+
+static gboolean on_dirty_timeout(gpointer data)
+{
+  GHashTableIter iter;
+  gpointer node;
+  g_hash_table_iter_init(&iter, dirty_contacts);
+  while (g_hash_table_iter_next(&iter, &node, NULL))
+    // contacts removed meanwhile are not in the index anymore
+    if (g_hash_table_lookup(quick_items, node))
+      reindex_node((PurpleBlistNode*)node);
+  g_hash_table_remove_all(dirty_contacts);
+  dirty_timeout = 0;
+  return FALSE;
+}
+
+static void touch_buddy(PurpleBlistNode* node)
+{
+  // contact alias may come from any of its buddies, the contact itself
+  // is refreshed later since it may be in the middle of modification
+  if (node->parent)
   {
-    item *val = g_new0(item, 1);
-    val->type = ACTION;
-    val->data = &actions[i];
-    append_item(result, actions[i].name, val);
+    g_hash_table_insert(dirty_contacts, node->parent, node->parent);
+    if (!dirty_timeout)
+      dirty_timeout = purple_timeout_add(0, on_dirty_timeout, NULL);
   }
-  g_sequence_sort(result, compare_pair, NULL);
-  return result;
 }
 
-static GSList* search_index(GSequence* index, const gchar* str)
+static void on_node_added(PurpleBlistNode* node, gpointer data)
+{
+  if (node->type == PURPLE_BLIST_BUDDY_NODE)
+    touch_buddy(node);
+  else
+    reindex_node(node);
+}
+
+static void on_node_removed(PurpleBlistNode* node, gpointer data)
 {
-  GSList *result = NULL;
-  if (str[0])
+  if (node->type == PURPLE_BLIST_BUDDY_NODE)
+    touch_buddy(node);
+  else
   {
-    pair p = {g_utf8_casefold(str, -1), NULL};
-    GSequenceIter* iter = g_sequence_search(index, &p, compare_pair, NULL);
-    //moving backward
-    for (; !g_sequence_iter_is_begin(iter); iter = g_sequence_iter_prev(iter))
-    {
-      pair* pp = (pair*)g_sequence_get(g_sequence_iter_prev(iter));
-      if (g_strcmp0(pp->key, p.key))
-        break;
-    }
-    //moving forward
-    for (; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter))
-    {
-      pair* pp = (pair*)g_sequence_get(iter);
-      if (!g_str_has_prefix(pp->key, p.key))
-        break;
-      if (!result)
-        result = g_slist_append(result, pp->value);
-      else
-      {
-        GSList* pos = result;
-        while(pos->data != pp->value)
-        {
-          if (pos->next)
-            pos = pos->next;
-          else
-          {
-            pos->next = g_slist_alloc();
-            pos->next->data = pp->value;
-          }
-        }
-      }
-    }
-    g_free(p.key);
+    g_hash_table_remove(dirty_contacts, node);
+    forget_item(node);
   }
+}
+
+static void on_node_aliased(PurpleBlistNode* node, const char* old_alias,
+    gpointer data)
+{
+  on_node_added(node, data);
+}
+
+// A contact without an alias of its own is named after its priority buddy,
+// which changes with presence; it is refreshed only if its name did.
+static void on_index_buddy_presence_changed(PurpleBuddy* buddy, gpointer data)
+{
+  PurpleBlistNode* contact = ((PurpleBlistNode*)buddy)->parent;
+  guint id = contact ?
+    GPOINTER_TO_UINT(g_hash_table_lookup(quick_items, contact)) : 0;
+  if (id && g_strcmp0(quick_index_get_text(item_index, id - 1),
+        purple_contact_get_alias((PurpleContact*)contact)))
+    touch_buddy((PurpleBlistNode*)buddy);
+}
+
+static void on_savedstatus_modified(PurpleSavedStatus* sst, gpointer data)
+{
+  forget_item(sst);
+  index_saved_status(sst);
+}
+
+static void on_savedstatus_deleted(PurpleSavedStatus* sst, gpointer data)
+{
+  forget_item(sst);
+}
+
+static void on_account_enabled(PurpleAccount* acct, gpointer data)
+{
+  forget_account(acct);
+  index_account(acct);
+}
+
+static void on_account_disabled(PurpleAccount* acct, gpointer data)
+{
+  forget_account(acct);
+}
+
+// alternate spellings depend on the keymap, the index builds the words of
+// all items again with the new layouts
+static void on_keys_changed(GdkKeymap* keymap, gpointer data)
+{
+  quick_index_set_layouts(item_index, read_layouts());
+}
+
+static void on_substrings_pref_changed(const char* name, PurplePrefType type,
+    gconstpointer val, gpointer data)
+{
+  quick_index_set_substrings(item_index, GPOINTER_TO_INT(val));
+}
+
+static void connect_index_signals(PurplePlugin* plugin)
+{
+  void* blist = purple_blist_get_handle();
+  void* savedstatuses = purple_savedstatuses_get_handle();
+  void* accounts = purple_accounts_get_handle();
+  purple_signal_connect(blist, "blist-node-added", plugin,
+      PURPLE_CALLBACK(on_node_added), NULL);
+  purple_signal_connect(blist, "blist-node-removed", plugin,
+      PURPLE_CALLBACK(on_node_removed), NULL);
+  purple_signal_connect(blist, "blist-node-aliased", plugin,
+      PURPLE_CALLBACK(on_node_aliased), NULL);
+  purple_signal_connect(blist, "buddy-status-changed", plugin,
+      PURPLE_CALLBACK(on_index_buddy_presence_changed), NULL);
+  purple_signal_connect(blist, "buddy-signed-on", plugin,
+      PURPLE_CALLBACK(on_index_buddy_presence_changed), NULL);
+  purple_signal_connect(blist, "buddy-signed-off", plugin,
+      PURPLE_CALLBACK(on_index_buddy_presence_changed), NULL);
+  purple_signal_connect(savedstatuses, "savedstatus-added", plugin,
+      PURPLE_CALLBACK(on_savedstatus_modified), NULL);
+  purple_signal_connect(savedstatuses, "savedstatus-modified", plugin,
+      PURPLE_CALLBACK(on_savedstatus_modified), NULL);
+  purple_signal_connect(savedstatuses, "savedstatus-deleted", plugin,
+      PURPLE_CALLBACK(on_savedstatus_deleted), NULL);
+  purple_signal_connect(accounts, "account-enabled", plugin,
+      PURPLE_CALLBACK(on_account_enabled), NULL);
+  purple_signal_connect(accounts, "account-disabled", plugin,
+      PURPLE_CALLBACK(on_account_disabled), NULL);
+  purple_signal_connect(accounts, "account-removed", plugin,
+      PURPLE_CALLBACK(on_account_disabled), NULL);
+  g_signal_connect(gdk_keymap_get_default(), "keys-changed",
+      (GCallback)on_keys_changed, NULL);
+  purple_signal_connect(purple_get_core(), "quitting", plugin,
+      PURPLE_CALLBACK(on_quitting), NULL);
+  purple_prefs_connect_callback(plugin, SUBSTRINGS_PREF,
+      on_substrings_pref_changed, NULL);
+}
+
+
+// NULL if the search has been cancelled
+static GPtrArray* search_items(const gchar* str, guint limit, guint* layout,
+    guint* matched)
+{
+  GArray* ids = quick_index_query(item_index, str, current_group,
+      limit, layout, matched);
+  GPtrArray* result;
+  guint i;
+  if (!ids)
+    return NULL;
+  result = g_ptr_array_sized_new(ids->len);
+  for (i = 0; i < ids->len; ++i)
+    g_ptr_array_add(result, get_item(g_array_index(ids, guint, i)));
+  g_array_free(ids, TRUE);
   return result;
 }
 
+static void destroy_index()
+{
+  if (dirty_timeout)
+    purple_timeout_remove(dirty_timeout);
+  dirty_timeout = 0;
+  flush_snapshot();
+  g_signal_handlers_disconnect_by_func(gdk_keymap_get_default(),
+      (gpointer)on_keys_changed, NULL);
+  quick_index_free(item_index);
+  item_index = NULL;
+  g_hash_table_destroy(dirty_contacts);
+  g_hash_table_destroy(quick_items);
+  g_ptr_array_free(item_blocks, TRUE);
+}
+
 // ui
 
 static void item_activate(item* item, const char* param)
@@ -301,6 +793,9 @@ static void item_activate(item* item, const char* param)
   const char* name;
   PurpleSavedStatus *saved;
   action* act;
+  if (item->dead)
+    return;
+  record_usage(item);
   switch(item->type)
   {
     case CONTACT:
@@ -345,9 +840,7 @@ static void item_activate(item* item, const char* param)
       purple_savedstatus_activate((PurpleSavedStatus*)item->data);
       break;
     case MESSAGE:
-      conv = (PurpleConversation*)((PurpleConvMessage*)item->data)->conv;
-      if (conv)
-        pidgin_conv_present_conversation(conv);
+      pidgin_conv_present_conversation((PurpleConversation*)item->data);
       break;
     case ACTION:
       act = (action*)item->data;
@@ -356,10 +849,14 @@ static void item_activate(item* item, const char* param)
   }
 }
 
+static gchar* message_get_text(item* val);
+
 static gchar* item_get_text(item* item)
 {
   PurpleStatus* status;
   PurpleAccount* account;
+  PurpleConvMessage* message;
+  GList* history;
   char* msg;
   char* text;
   switch(item->type)
@@ -382,10 +879,21 @@ static gchar* item_get_text(item* item)
     case STATUS_SAVED:
       return g_strdup(purple_savedstatus_get_title((PurpleSavedStatus*)item->data));
     case MESSAGE:
+      if (item->dead)
+        return NULL;
+      // messages found by a search carry their text
+      if (item->message)
+        return message_get_text(item);
+      history = purple_conversation_get_message_history(
+          (PurpleConversation*)item->data);
+      // the history may have been cleared since the conversation was unseen
+      if (!history)
+        return g_strdup(
+            purple_conversation_get_title((PurpleConversation*)item->data));
+      message = (PurpleConvMessage*)history->data;
       msg = purple_markup_strip_html(
-        purple_conversation_message_get_message((PurpleConvMessage*)item->data));
-      text = g_strdup_printf("<b>%s</b>: %s",
-          ((PurpleConvMessage*)item->data)->alias, msg);
+        purple_conversation_message_get_message(message));
+      text = g_strdup_printf("<b>%s</b>: %s", message->alias, msg);
       g_free(msg);
       return text;
     case ACTION:
@@ -394,10 +902,107 @@ static gchar* item_get_text(item* item)
   return NULL;
 }
 
+// Rendered icons are cached by stock id and by blist node, node icons are
+// dropped when the presence of any of the node buddies changes and
+// everything is dropped when the icon theme changes.
+
+static GHashTable* stock_icons = NULL;
+static GHashTable* node_icons = NULL;
+
+static void flush_icons()
+{
+  g_hash_table_remove_all(stock_icons);
+  g_hash_table_remove_all(node_icons);
+}
+
+static void on_icon_theme_changed(gpointer object, gpointer data)
+{
+  flush_icons();
+}
+
+static void on_icon_pref_changed(const char* name, PurplePrefType type,
+    gconstpointer val, gpointer data)
+{
+  flush_icons();
+}
+
+static void on_buddy_presence_changed(PurpleBuddy* buddy, gpointer data)
+{
+  g_hash_table_remove(node_icons, ((PurpleBlistNode*)buddy)->parent);
+}
+
+static void on_icon_node_removed(PurpleBlistNode* node, gpointer data)
+{
+  g_hash_table_remove(node_icons, node);
+}
+
+static void on_account_signed_off(PurpleAccount* account, gpointer data)
+{
+  g_hash_table_remove_all(node_icons);
+}
+
+static void create_icon_cache(PurplePlugin* plugin)
+{
+  void* blist = purple_blist_get_handle();
+  stock_icons = g_hash_table_new_full(g_str_hash, g_str_equal,
+      g_free, g_object_unref);
+  node_icons = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+      NULL, g_object_unref);
+  g_signal_connect(gtk_icon_theme_get_default(), "changed",
+      (GCallback)on_icon_theme_changed, NULL);
+  purple_prefs_connect_callback(plugin, "/pidgin/status/icon-theme",
+      on_icon_pref_changed, NULL);
+  purple_signal_connect(blist, "buddy-status-changed", plugin,
+      PURPLE_CALLBACK(on_buddy_presence_changed), NULL);
+  purple_signal_connect(blist, "buddy-idle-changed", plugin,
+      PURPLE_CALLBACK(on_buddy_presence_changed), NULL);
+  purple_signal_connect(blist, "buddy-signed-on", plugin,
+      PURPLE_CALLBACK(on_buddy_presence_changed), NULL);
+  purple_signal_connect(blist, "buddy-signed-off", plugin,
+      PURPLE_CALLBACK(on_buddy_presence_changed), NULL);
+  purple_signal_connect(blist, "blist-node-removed", plugin,
+      PURPLE_CALLBACK(on_icon_node_removed), NULL);
+  purple_signal_connect(purple_accounts_get_handle(), "account-signed-off",
+      plugin, PURPLE_CALLBACK(on_account_signed_off), NULL);
+}
+
+static void destroy_icon_cache(PurplePlugin* plugin)
+{
+  g_signal_handlers_disconnect_by_func(gtk_icon_theme_get_default(),
+      (gpointer)on_icon_theme_changed, NULL);
+  purple_prefs_disconnect_by_handle(plugin);
+  g_hash_table_destroy(stock_icons);
+  g_hash_table_destroy(node_icons);
+}
+
 static GdkPixbuf* render_stock_icon(const char* stock, GtkTreeView* tree)
 {
-	GtkIconSize size = gtk_icon_size_from_name(PIDGIN_ICON_SIZE_TANGO_EXTRA_SMALL);
-	return gtk_widget_render_icon((GtkWidget*)tree, stock, size, "GtkTreeView");
+  GdkPixbuf* pixbuf;
+  if (!stock)
+    return NULL;
+  pixbuf = (GdkPixbuf*)g_hash_table_lookup(stock_icons, stock);
+  if (!pixbuf)
+  {
+    GtkIconSize size = gtk_icon_size_from_name(PIDGIN_ICON_SIZE_TANGO_EXTRA_SMALL);
+    pixbuf = gtk_widget_render_icon((GtkWidget*)tree, stock, size, "GtkTreeView");
+    if (!pixbuf)
+      return NULL;
+    g_hash_table_insert(stock_icons, g_strdup(stock), pixbuf);
+  }
+  return (GdkPixbuf*)g_object_ref(pixbuf);
+}
+
+static GdkPixbuf* get_node_icon(PurpleBlistNode* node)
+{
+  GdkPixbuf* pixbuf = (GdkPixbuf*)g_hash_table_lookup(node_icons, node);
+  if (!pixbuf)
+  {
+    pixbuf = pidgin_blist_get_status_icon(node, PIDGIN_STATUS_ICON_LARGE);
+    if (!pixbuf)
+      return NULL;
+    g_hash_table_insert(node_icons, node, pixbuf);
+  }
+  return (GdkPixbuf*)g_object_ref(pixbuf);
 }
 
 static GdkPixbuf* get_icon_for_primitive(
@@ -413,8 +1018,7 @@ static GdkPixbuf* item_get_icon(item* item, GtkTreeView* tree)
   {
     case CONTACT:
     case CHAT:
-      return pidgin_blist_get_status_icon((PurpleBlistNode*)item->data,
-          PIDGIN_STATUS_ICON_LARGE);
+      return get_node_icon((PurpleBlistNode*)item->data);
     case STATUS:
       return get_icon_for_primitive(
           purple_status_type_get_primitive(
@@ -470,6 +1074,32 @@ static void move_selection(GtkTreeView* tree, gboolean up)
   gtk_tree_path_free(path);
 }
 
+// The window is built once at load and only hidden in between, showing
+// it resets the query and the results. The time from the hotkey to the
+// first paint is logged to the debug window.
+
+static GtkWidget* quick_window = NULL;
+static gint64 show_time = 0;
+
+static void populate_tree(GtkTreeView* tree, GPtrArray* items, gboolean fixed,
+    guint limit);
+static void schedule_search(GtkEntryBuffer* buffer);
+static void load_more_results(GtkTreeView* tree);
+static void free_retired_unread();
+static void compact_messages();
+
+static void hide_ui()
+{
+  GtkEntry* entry = (GtkEntry*)g_object_get_data((GObject*)quick_window, "quickpurple-entry");
+  GtkTreeView* tree = (GtkTreeView*)g_object_get_data((GObject*)entry, "quickpurple-tree");
+  gtk_widget_hide(quick_window);
+  // no item is kept alive by a hidden result list
+  populate_tree(tree, g_ptr_array_new(), FALSE, 0);
+  quick_index_hold_ids(item_index, FALSE);
+  free_retired_unread();
+  compact_messages();
+}
+
 static void on_row_activated(GtkTreeView* tree, GtkTreePath* path, 
     GtkTreeViewColumn* col, gpointer user_data)
 {
@@ -491,7 +1121,7 @@ static void on_row_activated(GtkTreeView* tree, GtkTreePath* path,
           param = NULL;
       }
       item_activate((item*)g_value_get_pointer(&value), param);
-      gtk_widget_destroy((GtkWidget*)user_data);
+      hide_ui();
     }
   }
 }
@@ -500,6 +1130,7 @@ static gboolean on_entry_key_pressed(GtkWidget* widget,
     GdkEventKey* event, gpointer user_data)
 {
   GtkTreeView* tree = (GtkTreeView*)g_object_get_data((GObject*)widget, "quickpurple-tree");
+  current_group = event->group;
   if (event->keyval == GDK_KEY_Up ||
     ((event->state & GDK_CONTROL_MASK) && event->hardware_keycode == 0x2d))
   {
@@ -509,6 +1140,12 @@ static gboolean on_entry_key_pressed(GtkWidget* widget,
   else if (event->keyval == GDK_KEY_Down ||
       ((event->state & GDK_CONTROL_MASK) && event->hardware_keycode == 0x2c))
   {
+    GtkTreePath* path = get_selected_path(tree);
+    if (path && gtk_tree_path_get_indices(path)[0] + 1 >=
+        gtk_tree_model_iter_n_children(gtk_tree_view_get_model(tree), NULL))
+      load_more_results(tree);
+    if (path)
+      gtk_tree_path_free(path);
     move_selection(tree, FALSE);
     return TRUE;
   }
@@ -522,97 +1159,671 @@ static gboolean on_entry_key_pressed(GtkWidget* widget,
   return FALSE;
 } 
 
-static void populate_tree(GtkTreeView* tree, GSList* list)
+// A list model over an array of items computing row icons and texts only
+// when the tree view asks for them, that is for visible rows when the
+// tree is in fixed height mode.
+
+typedef struct _result_list
 {
-  GtkTreeSelection* sel;
-  GtkTreeIter first;
-  GtkListStore* model = 
-    gtk_list_store_new(3, GDK_TYPE_PIXBUF, G_TYPE_STRING, G_TYPE_POINTER);
-  GSList* cur;
-  for (cur = list; cur; cur = cur->next)
+  GObject parent;
+  GPtrArray* items;
+  GtkTreeView* tree;
+  gint stamp;
+  // the number of results searched for, more may be found if there are
+  // as many rows; 0 if all of them are listed
+  guint limit;
+} result_list;
+
+typedef struct _result_list_class
+{
+  GObjectClass parent_class;
+} result_list_class;
+
+static GObjectClass* result_list_parent_class = NULL;
+
+static GtkTreeModelFlags result_list_get_flags(GtkTreeModel* model)
+{
+  return GTK_TREE_MODEL_LIST_ONLY | GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+static gint result_list_get_n_columns(GtkTreeModel* model)
+{
+  return 3;
+}
+
+static GType result_list_get_column_type(GtkTreeModel* model, gint column)
+{
+  switch(column)
   {
-    GtkTreeIter iter;
-    item* i = (item*)cur->data;
-    gchar* text = item_get_text(i);
-    GdkPixbuf* pixbuf = item_get_icon(i, tree);
-    gtk_list_store_append(model, &iter);
-    gtk_list_store_set(model, &iter, 0, pixbuf, 1, text, 2, i, -1);
-    if (pixbuf)
-      g_object_unref(pixbuf);
-    g_free(text);
+    case 0:
+      return GDK_TYPE_PIXBUF;
+    case 1:
+      return G_TYPE_STRING;
+    default:
+      return G_TYPE_POINTER;
+  }
+}
+
+static gboolean result_list_set_iter(GtkTreeModel* model, GtkTreeIter* iter,
+    gint n)
+{
+  result_list* list = (result_list*)model;
+  if (n < 0 || n >= list->items->len)
+    return FALSE;
+  iter->stamp = list->stamp;
+  iter->user_data = GINT_TO_POINTER(n);
+  return TRUE;
+}
+
+static gboolean result_list_get_iter(GtkTreeModel* model, GtkTreeIter* iter,
+    GtkTreePath* path)
+{
+  return result_list_set_iter(model, iter, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath* result_list_get_path(GtkTreeModel* model, GtkTreeIter* iter)
+{
+  return gtk_tree_path_new_from_indices(GPOINTER_TO_INT(iter->user_data), -1);
+}
+
+static void result_list_get_value(GtkTreeModel* model, GtkTreeIter* iter,
+    gint column, GValue* value)
+{
+  result_list* list = (result_list*)model;
+  item* val = (item*)g_ptr_array_index(list->items,
+      GPOINTER_TO_INT(iter->user_data));
+  g_value_init(value, result_list_get_column_type(model, column));
+  // the object behind a dead item may have been freed already, its row is
+  // left blank until the list is searched again
+  switch(column)
+  {
+    case 0:
+      if (!val->dead)
+        g_value_take_object(value, item_get_icon(val, list->tree));
+      break;
+    case 1:
+      if (!val->dead)
+        g_value_take_string(value, item_get_text(val));
+      break;
+    default:
+      g_value_set_pointer(value, val);
+      break;
+  }
+}
+
+static gboolean result_list_iter_next(GtkTreeModel* model, GtkTreeIter* iter)
+{
+  return result_list_set_iter(model, iter, GPOINTER_TO_INT(iter->user_data) + 1);
+}
+
+static gboolean result_list_iter_children(GtkTreeModel* model,
+    GtkTreeIter* iter, GtkTreeIter* parent)
+{
+  return !parent && result_list_set_iter(model, iter, 0);
+}
+
+static gboolean result_list_iter_has_child(GtkTreeModel* model,
+    GtkTreeIter* iter)
+{
+  return FALSE;
+}
+
+static gint result_list_iter_n_children(GtkTreeModel* model, GtkTreeIter* iter)
+{
+  return iter ? 0 : ((result_list*)model)->items->len;
+}
+
+static gboolean result_list_iter_nth_child(GtkTreeModel* model,
+    GtkTreeIter* iter, GtkTreeIter* parent, gint n)
+{
+  return !parent && result_list_set_iter(model, iter, n);
+}
+
+static gboolean result_list_iter_parent(GtkTreeModel* model,
+    GtkTreeIter* iter, GtkTreeIter* child)
+{
+  return FALSE;
+}
+
+static void result_list_finalize(GObject* object)
+{
+  g_ptr_array_free(((result_list*)object)->items, TRUE);
+  result_list_parent_class->finalize(object);
+}
+
+static void result_list_class_init(gpointer klass, gpointer data)
+{
+  result_list_parent_class = (GObjectClass*)g_type_class_peek_parent(klass);
+  ((GObjectClass*)klass)->finalize = result_list_finalize;
+}
+
+static void result_list_tree_model_init(gpointer g_iface, gpointer data)
+{
+  GtkTreeModelIface* iface = (GtkTreeModelIface*)g_iface;
+  iface->get_flags = result_list_get_flags;
+  iface->get_n_columns = result_list_get_n_columns;
+  iface->get_column_type = result_list_get_column_type;
+  iface->get_iter = result_list_get_iter;
+  iface->get_path = result_list_get_path;
+  iface->get_value = result_list_get_value;
+  iface->iter_next = result_list_iter_next;
+  iface->iter_children = result_list_iter_children;
+  iface->iter_has_child = result_list_iter_has_child;
+  iface->iter_n_children = result_list_iter_n_children;
+  iface->iter_nth_child = result_list_iter_nth_child;
+  iface->iter_parent = result_list_iter_parent;
+}
+
+static GType result_list_get_type()
+{
+  static GType type = 0;
+  if (!type)
+  {
+    static const GTypeInfo info =
+    {
+      sizeof(result_list_class),
+      NULL,
+      NULL,
+      result_list_class_init,
+      NULL,
+      NULL,
+      sizeof(result_list),
+      0,
+      NULL,
+      NULL
+    };
+    static const GInterfaceInfo tree_model_info =
+    {
+      result_list_tree_model_init,
+      NULL,
+      NULL
+    };
+    type = g_type_register_static(G_TYPE_OBJECT, "QuickpurpleResultList",
+        &info, 0);
+    g_type_add_interface_static(type, GTK_TYPE_TREE_MODEL, &tree_model_info);
   }
-  gtk_tree_view_set_model(tree, (GtkTreeModel*)model);
+  return type;
+}
+
+static GtkTreeModel* result_list_new(GPtrArray* items, GtkTreeView* tree,
+    guint limit)
+{
+  result_list* list = (result_list*)g_object_new(result_list_get_type(), NULL);
+  list->items = items;
+  list->tree = tree;
+  list->stamp = g_random_int();
+  list->limit = limit;
+  return (GtkTreeModel*)list;
+}
+
+// Appends the items not listed yet, leaving the rows shown and the
+// selection as they are. Takes ownership of the items array.
+static void result_list_append(result_list* list, GPtrArray* items)
+{
+  GHashTable* listed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  guint i;
+  for (i = 0; i < list->items->len; ++i)
+    g_hash_table_insert(listed, list->items->pdata[i], list->items->pdata[i]);
+  for (i = 0; i < items->len; ++i)
+    if (!g_hash_table_lookup(listed, items->pdata[i]))
+    {
+      GtkTreeIter iter;
+      GtkTreePath* path;
+      g_ptr_array_add(list->items, items->pdata[i]);
+      result_list_set_iter((GtkTreeModel*)list, &iter, list->items->len - 1);
+      path = result_list_get_path((GtkTreeModel*)list, &iter);
+      gtk_tree_model_row_inserted((GtkTreeModel*)list, path, &iter);
+      gtk_tree_path_free(path);
+    }
+  g_hash_table_destroy(listed);
+  g_ptr_array_free(items, TRUE);
+}
+
+// takes ownership of the items array, the first limit results of a search
+// or all of them if limit is 0
+static void populate_tree(GtkTreeView* tree, GPtrArray* items, gboolean fixed,
+    guint limit)
+{
+  GtkTreeSelection* sel;
+  GtkTreeIter first;
+  GtkTreeModel* model = result_list_new(items, tree, limit);
+  // a page left to fetch was one of the former results
+  g_object_set_data((GObject*)tree, "quickpurple-more", NULL);
+  // fixed height rows are measured only when shown, messages may wrap
+  gtk_tree_view_set_fixed_height_mode(tree, fixed);
+  gtk_tree_view_set_model(tree, model);
+  g_object_unref(model);
   sel = gtk_tree_view_get_selection(tree);
-  if (gtk_tree_model_get_iter_first((GtkTreeModel*)model, &first))
+  if (gtk_tree_model_get_iter_first(model, &first))
     gtk_tree_selection_select_iter(sel, &first);
 }
 
-static GSList* get_unread_messages()
+// Conversations with unseen messages are tracked from conversation
+// signals, the most recently active first, so the window shows them
+// without scanning conversations. Items of conversations which are seen
+// are freed once no result list may show them anymore.
+
+static GQueue* unread_items = NULL;
+static GHashTable* unread_links = NULL;
+static GSList* retired_unread = NULL;
+
+static gboolean conv_unseen(PurpleConversation* conv)
+{
+  PidginConversation* gtkconv = PIDGIN_CONVERSATION(conv);
+  return gtkconv && gtkconv->active_conv == conv
+    && gtkconv->unseen_state >= PIDGIN_UNSEEN_TEXT
+    && purple_conversation_get_message_history(conv);
+}
+
+static void add_unread(PurpleConversation* conv, gboolean recent)
 {
-  GSList* result = NULL;
-  GList* convs = g_list_concat(
+  item* val = g_new0(item, 1);
+  val->type = MESSAGE;
+  val->data = conv;
+  if (recent)
+    g_queue_push_head(unread_items, val);
+  else
+    g_queue_push_tail(unread_items, val);
+  g_hash_table_insert(unread_links, conv,
+      recent ? unread_items->head : unread_items->tail);
+}
+
+static void forget_unread(PurpleConversation* conv)
+{
+  GList* link = (GList*)g_hash_table_lookup(unread_links, conv);
+  item* val;
+  if (!link)
+    return;
+  val = (item*)link->data;
+  g_hash_table_remove(unread_links, conv);
+  g_queue_delete_link(unread_items, link);
+  val->dead = TRUE;
+  if (quick_window && gtk_widget_get_visible(quick_window))
+    retired_unread = g_slist_prepend(retired_unread, val);
+  else
+    g_free(val);
+}
+
+static void free_retired_unread()
+{
+  g_slist_foreach(retired_unread, (GFunc)g_free, NULL);
+  g_slist_free(retired_unread);
+  retired_unread = NULL;
+}
+
+static void on_conversation_updated(PurpleConversation* conv,
+    PurpleConvUpdateType type, gpointer data)
+{
+  if (type != PURPLE_CONV_UPDATE_UNSEEN)
+    return;
+  if (!conv_unseen(conv))
+    forget_unread(conv);
+  else if (!g_hash_table_lookup(unread_links, conv))
+    add_unread(conv, TRUE);
+}
+
+static void on_received_msg(PurpleAccount* account, char* sender,
+    char* message, PurpleConversation* conv, PurpleMessageFlags flags,
+    gpointer data)
+{
+  GList* link = conv ? (GList*)g_hash_table_lookup(unread_links, conv) : NULL;
+  if (link)
+  {
+    g_queue_unlink(unread_items, link);
+    g_queue_push_head_link(unread_items, link);
+  }
+}
+
+static void on_deleting_conversation(PurpleConversation* conv, gpointer data)
+{
+  forget_unread(conv);
+}
+
+static void create_unread_tracker(PurplePlugin* plugin)
+{
+  void* convs = purple_conversations_get_handle();
+  GList* unseen = g_list_concat(
       pidgin_conversations_find_unseen_list(PURPLE_CONV_TYPE_IM,
         PIDGIN_UNSEEN_TEXT, FALSE, 0),
       pidgin_conversations_find_unseen_list(PURPLE_CONV_TYPE_CHAT,
         PIDGIN_UNSEEN_TEXT, FALSE, 0));
   GList* cur;
-  for (cur = convs; cur; cur = cur->next)
+  unread_items = g_queue_new();
+  unread_links = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (cur = unseen; cur; cur = cur->next)
+    if (conv_unseen((PurpleConversation*)cur->data))
+      add_unread((PurpleConversation*)cur->data, FALSE);
+  g_list_free(unseen);
+  purple_signal_connect(convs, "conversation-updated", plugin,
+      PURPLE_CALLBACK(on_conversation_updated), NULL);
+  purple_signal_connect(convs, "received-im-msg", plugin,
+      PURPLE_CALLBACK(on_received_msg), NULL);
+  purple_signal_connect(convs, "received-chat-msg", plugin,
+      PURPLE_CALLBACK(on_received_msg), NULL);
+  purple_signal_connect(convs, "deleting-conversation", plugin,
+      PURPLE_CALLBACK(on_deleting_conversation), NULL);
+}
+
+static void destroy_unread_tracker()
+{
+  g_queue_foreach(unread_items, (GFunc)g_free, NULL);
+  g_queue_free(unread_items);
+  unread_items = NULL;
+  g_hash_table_destroy(unread_links);
+  unread_links = NULL;
+  free_retired_unread();
+}
+
+static GPtrArray* get_unread_messages()
+{
+  GPtrArray* result = g_ptr_array_sized_new(unread_items->length);
+  GList* cur;
+  for (cur = unread_items->head; cur; cur = cur->next)
+    g_ptr_array_add(result, cur->data);
+  return result;
+}
+
+// message search
+
+// Queries starting with the prefix search the messages of the open
+// conversations, indexed by the engine as they are written. Messages found
+// are MESSAGE items carrying their id, those of closed conversations are
+// dropped once they make up half of the messages and no result list shows
+// them. The
+// prefix is a slash, as no chat is named with one, unlike the hash of IRC
+// channels.
+
+#define MESSAGE_PREFIX '/'
+
+static quick_messages* message_index = NULL;
+// the MESSAGE items of the messages by their ids
+static GPtrArray* message_blocks = NULL;
+static guint num_messages = 0;
+static guint dead_messages = 0;
+
+static gchar* message_get_text(item* val)
+{
+  return g_markup_printf_escaped("<b>%s</b>: %s",
+      quick_messages_get_who(message_index, val->message - 1),
+      quick_messages_get_text(message_index, val->message - 1));
+}
+
+// Items of the messages are numbered again the way the message index
+// numbers the messages left.
+static void compact_messages()
+{
+  GPtrArray* blocks = message_blocks;
+  guint i, count = num_messages;
+  if (dead_messages * 2 <= num_messages
+      || (quick_window && gtk_widget_get_visible(quick_window)))
+    return;
+  quick_messages_compact(message_index);
+  message_blocks = g_ptr_array_new_with_free_func(g_free);
+  num_messages = 0;
+  dead_messages = 0;
+  for (i = 0; i < count; ++i)
   {
-    GList* messages = purple_conversation_get_message_history(
-        (PurpleConversation*)cur->data);
-    item *val = g_new0(item, 1);
-    val->type = MESSAGE;
-    val->data = messages->data;
-    result = g_slist_append(result, val);
+    item* val = get_block_item(blocks, i);
+    if (!val->dead)
+    {
+      item* moved = new_block_item(message_blocks, num_messages);
+      *moved = *val;
+      moved->message = ++num_messages;
+    }
   }
-  g_list_free(convs);
-  return result;
+  g_ptr_array_free(blocks, TRUE);
 }
 
-static void on_changed(GtkEntryBuffer* buffer, GSequence* index)
+static void add_message(PurpleConversation* conv, const char* who,
+    const char* html)
 {
-  const gchar* text = gtk_entry_buffer_get_text(buffer);
-  gchar** parts = g_strsplit_set(text, " ", 2);
-  const gchar* key = parts[0] ? parts[0] : text;
-  GSList* list = search_index(index, key);
-  if (!list)
-  {
-    GSList* alts = transform(key);
-    GSList* cur = alts;
-    transformation* tr = NULL;
-    for (; cur && !list; cur = cur->next)
+  gchar* text = purple_markup_strip_html(html);
+  guint id = quick_messages_add(message_index, who ? who : "", text);
+  item* val = new_block_item(message_blocks, id);
+  val->type = MESSAGE;
+  val->data = conv;
+  val->message = num_messages = id + 1;
+  g_free(text);
+}
+
+static void on_wrote_msg(PurpleAccount* account, const char* who,
+    char* message, PurpleConversation* conv, PurpleMessageFlags flags,
+    gpointer data)
+{
+  if (conv && message)
+    add_message(conv, who, message);
+}
+
+static void on_message_conversation_deleted(PurpleConversation* conv,
+    gpointer data)
+{
+  guint i;
+  for (i = 0; i < num_messages; ++i)
+  {
+    item* val = get_block_item(message_blocks, i);
+    if (val->data == conv && !val->dead)
     {
-      tr = (transformation*)cur->data;
-      list = search_index(index, tr->str);
+      val->dead = TRUE;
+      quick_messages_remove(message_index, i);
+      ++dead_messages;
     }
-    if (list)
+  }
+  compact_messages();
+}
+
+static void create_message_index(PurplePlugin* plugin)
+{
+  void* convs = purple_conversations_get_handle();
+  GList* cur;
+  message_index = quick_messages_new();
+  message_blocks = g_ptr_array_new_with_free_func(g_free);
+  num_messages = 0;
+  dead_messages = 0;
+  for (cur = purple_get_conversations(); cur; cur = cur->next)
+  {
+    PurpleConversation* conv = (PurpleConversation*)cur->data;
+    GList* history = g_list_last(purple_conversation_get_message_history(conv));
+    // the history is newest first
+    for (; history; history = history->prev)
     {
-      gtk_entry_buffer_set_text(buffer, tr->str, -1);
-      XkbLockGroup(gdk_x11_get_default_xdisplay(), XkbUseCoreKbd, tr->group);
+      PurpleConvMessage* msg = (PurpleConvMessage*)history->data;
+      add_message(conv, msg->alias ? msg->alias : msg->who, msg->what);
     }
-    for (cur = alts; cur; cur = cur->next)
+  }
+  purple_signal_connect(convs, "wrote-im-msg", plugin,
+      PURPLE_CALLBACK(on_wrote_msg), NULL);
+  purple_signal_connect(convs, "wrote-chat-msg", plugin,
+      PURPLE_CALLBACK(on_wrote_msg), NULL);
+  purple_signal_connect(convs, "deleting-conversation", plugin,
+      PURPLE_CALLBACK(on_message_conversation_deleted), NULL);
+}
+
+static void destroy_message_index()
+{
+  quick_messages_free(message_index);
+  g_ptr_array_free(message_blocks, TRUE);
+  message_index = NULL;
+  message_blocks = NULL;
+}
+
+// the newest limit messages having all the words of the query
+static GPtrArray* search_messages(const gchar* query, guint limit)
+{
+  GArray* ids = quick_messages_query(message_index, query, limit);
+  GPtrArray* result = g_ptr_array_sized_new(ids->len);
+  guint i;
+  for (i = 0; i < ids->len; ++i)
+    g_ptr_array_add(result,
+        get_block_item(message_blocks, g_array_index(ids, guint, i)));
+  g_array_free(ids, TRUE);
+  return result;
+}
+
+// Status primitives matching the first word of a query of several, the
+// rest of the query being the message they are set with. Those having a
+// word starting with it come before the results matched fuzzily so they
+// are on the first page, the others after. FALSE if the search has been
+// cancelled.
+static gboolean add_status_items(GPtrArray* result, guint matched,
+    const gchar* key, guint limit)
+{
+  guint layout, words, i, j;
+  GPtrArray* found = search_items(key, limit, &layout, &words);
+  if (!found)
+    return FALSE;
+  for (i = 0; i < found->len; ++i)
+  {
+    item* val = (item*)found->pdata[i];
+    if (val->type != STATUS_PRIMITIVE)
+      continue;
+    for (j = 0; j < result->len && result->pdata[j] != val; ++j)
+      ;
+    if (i < words && j >= matched)
     {
-      tr = (transformation*)cur->data;
-      g_free(tr->str);
-      g_free(tr);
+      // moved up from the fuzzy results if it was one
+      if (j < result->len)
+        g_ptr_array_remove_index(result, j);
+      g_ptr_array_add(result, NULL);
+      memmove(result->pdata + matched + 1, result->pdata + matched,
+          (result->len - matched - 1) * sizeof(gpointer));
+      result->pdata[matched++] = val;
     }
-    g_slist_free(alts);
+    else if (j == result->len)
+      g_ptr_array_add(result, val);
+  }
+  g_ptr_array_free(found, TRUE);
+  if (result->len > limit)
+    g_ptr_array_set_size(result, limit);
+  return TRUE;
+}
+
+// The best limit results of the text typed, NULL if the search has been
+// cancelled.
+static GPtrArray* search_text(const gchar* text, guint limit, guint* layout)
+{
+  gchar** parts;
+  GPtrArray* result;
+  guint matched;
+  *layout = 0;
+  if (text[0] == MESSAGE_PREFIX)
+    return search_messages(text + 1, limit);
+  parts = g_strsplit_set(text, " ", 2);
+  result = search_items(text, limit, layout, &matched);
+  if (result && parts[0] && parts[1] && *parts[0]
+      && !add_status_items(result, matched, parts[0], limit))
+  {
+    g_ptr_array_free(result, TRUE);
+    result = NULL;
   }
   g_strfreev(parts);
+  return result;
+}
+
+static void remove_search_source(gpointer data)
+{
+  g_source_remove(GPOINTER_TO_UINT(data));
+}
+
+static gboolean on_more_idle(gpointer data)
+{
+  GtkTreeView* tree = (GtkTreeView*)data;
+  g_object_steal_data((GObject*)tree, "quickpurple-more");
+  load_more_results(tree);
+  return FALSE;
+}
+
+// Rows are fetched a page at a time, moving past the last one or scrolling
+// down to it searches the same text again for a page more. A fetch
+// cancelled by a key press is tried again once it has been handled.
+static void load_more_results(GtkTreeView* tree)
+{
+  result_list* list = (result_list*)gtk_tree_view_get_model(tree);
+  GtkEntryBuffer* buffer =
+    (GtkEntryBuffer*)g_object_get_data((GObject*)tree, "quickpurple-buffer");
+  GPtrArray* found;
+  guint layout;
+  // the list has as many rows as it was searched for and its text is
+  // still the one typed
+  if (!list || !list->limit || list->items->len < list->limit
+      || g_object_get_data((GObject*)buffer, "quickpurple-search"))
+    return;
+  found = search_text(gtk_entry_buffer_get_text(buffer),
+      list->limit + RESULTS_PAGE, &layout);
+  if (found)
+  {
+    list->limit += RESULTS_PAGE;
+    result_list_append(list, found);
+  }
+  else if (!g_object_get_data((GObject*)tree, "quickpurple-more"))
+    g_object_set_data_full((GObject*)tree, "quickpurple-more",
+        GUINT_TO_POINTER(g_idle_add(on_more_idle, tree)),
+        remove_search_source);
+}
+
+static void on_results_scrolled(GtkAdjustment* adj, gpointer data)
+{
+  if (gtk_adjustment_get_value(adj) + gtk_adjustment_get_page_size(adj)
+      >= gtk_adjustment_get_upper(adj))
+    load_more_results((GtkTreeView*)data);
+}
+
+static void on_changed(GtkEntryBuffer* buffer)
+{
+  const gchar* text = gtk_entry_buffer_get_text(buffer);
   GtkTreeView* tree = (GtkTreeView*)g_object_get_data((GObject*)buffer, "quickpurple-tree");
-  populate_tree(tree, list);
-  g_slist_free(list);
+  guint layout;
+  GPtrArray* result = search_text(text, RESULTS_PAGE, &layout);
+  if (!result)
+  {
+    schedule_search(buffer);
+    return;
+  }
+  // messages wrap, their rows are measured each
+  populate_tree(tree, result, text[0] != MESSAGE_PREFIX, RESULTS_PAGE);
+  if (layout)
+  {
+    gchar* converted = quick_index_convert_layout(item_index, text,
+        current_group, layout - 1);
+    if (converted)
+    {
+      gtk_entry_buffer_set_text(buffer, converted, -1);
+      // the results already are those of the converted text
+      g_object_set_data((GObject*)buffer, "quickpurple-search", NULL);
+      g_free(converted);
+    }
+    XkbLockGroup(gdk_x11_get_default_xdisplay(), XkbUseCoreKbd, layout - 1);
+    current_group = layout - 1;
+  }
+}
+
+// A search runs at most once per main loop iteration on the latest buffer
+// text, however many times the buffer changed since it was scheduled.
+
+static gboolean on_search_idle(gpointer data)
+{
+  GtkEntryBuffer* buffer = (GtkEntryBuffer*)data;
+  g_object_steal_data((GObject*)buffer, "quickpurple-search");
+  on_changed(buffer);
+  return FALSE;
+}
+
+static void schedule_search(GtkEntryBuffer* buffer)
+{
+  if (!g_object_get_data((GObject*)buffer, "quickpurple-search"))
+    g_object_set_data_full((GObject*)buffer, "quickpurple-search",
+        GUINT_TO_POINTER(g_idle_add(on_search_idle, buffer)),
+        remove_search_source);
 }
 
 static void on_deleted(GtkEntryBuffer* buffer, guint pos, guint n_chars, gpointer user_data)
 {
-  on_changed(buffer, (GSequence*)user_data);
+  schedule_search(buffer);
 }
 
 static void on_inserted(GtkEntryBuffer* buffer, guint pos, 
     gchar* chars, guint n_chars, gpointer user_data)
 {
-  on_changed(buffer, (GSequence*)user_data);
+  schedule_search(buffer);
 }
 
 static gboolean on_win_key_pressed(GtkWidget* widget, 
@@ -620,21 +1831,33 @@ static gboolean on_win_key_pressed(GtkWidget* widget,
 {
   if (event->keyval == GDK_KEY_Escape)
   {
-    gtk_widget_destroy(widget);
+    hide_ui();
     return TRUE;
   }
   return FALSE;
 }
 
-static void on_destroy(GtkWidget* object, gpointer user_data)
+static gboolean on_win_deleted(GtkWidget* widget, GdkEvent* event,
+    gpointer user_data)
 {
-  g_sequence_free((GSequence*)user_data);
+  hide_ui();
+  return TRUE;
 }
 
-static void create_ui(GSequence* index)
+static gboolean on_win_exposed(GtkWidget* widget, GdkEventExpose* event,
+    gpointer user_data)
 {
-  GSList* messages;
+  if (show_time)
+  {
+    purple_debug_info("quickpurple", "hotkey to first paint: %.1f ms\n",
+        (g_get_monotonic_time() - show_time) / 1000.0);
+    show_time = 0;
+  }
+  return FALSE;
+}
 
+static void create_ui()
+{
   GtkWindow* win = (GtkWindow*)gtk_window_new(GTK_WINDOW_TOPLEVEL);
   GtkWidget* vbox = gtk_vbox_new(FALSE, 4);
   GtkEntry* entry = (GtkEntry*)gtk_entry_new();
@@ -648,46 +1871,76 @@ static void create_ui(GSequence* index)
   gtk_window_set_type_hint(win, GDK_WINDOW_TYPE_HINT_DIALOG);
   gtk_widget_set_size_request((GtkWidget*)win, -1,256);
   gtk_window_set_position(win, GTK_WIN_POS_CENTER);
-  g_signal_connect((GtkWidget*)win, "destroy", (GCallback)on_destroy, index);
   g_signal_connect((GtkWidget*)win, "key-press-event",
       (GCallback)on_win_key_pressed, NULL);
+  g_signal_connect((GtkWidget*)win, "delete-event",
+      (GCallback)on_win_deleted, NULL);
+  g_signal_connect_after((GtkWidget*)win, "expose-event",
+      (GCallback)on_win_exposed, NULL);
+  g_object_set_data((GObject*)win, "quickpurple-entry", entry);
   g_object_set_data((GObject*)entry, "quickpurple-tree", tree);
   gtk_entry_set_width_chars(entry, 32);
   g_signal_connect((GtkWidget*)entry, "key-press-event",
       (GCallback)on_entry_key_pressed, NULL);
-  g_signal_connect((GtkWidget*)buffer, "deleted-text", (GCallback)on_deleted, index);
-  g_signal_connect((GtkWidget*)buffer, "inserted-text", (GCallback)on_inserted, index);
+  g_signal_connect((GtkWidget*)buffer, "deleted-text", (GCallback)on_deleted, NULL);
+  g_signal_connect((GtkWidget*)buffer, "inserted-text", (GCallback)on_inserted, NULL);
   g_object_set_data((GObject*)buffer, "quickpurple-tree", tree);
   gtk_scrolled_window_set_policy((GtkScrolledWindow*)scroll, 
       GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
   gtk_scrolled_window_set_shadow_type((GtkScrolledWindow*)scroll, GTK_SHADOW_IN);
   gtk_tree_view_set_headers_visible(tree, FALSE);
   g_object_set(text_rend, "wrap-mode", PANGO_WRAP_WORD, "wrap-width", 400, NULL);
+  gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+  gtk_tree_view_column_set_expand(col, TRUE);
   gtk_tree_view_column_pack_start(col, icon_rend, FALSE);
   gtk_tree_view_column_add_attribute(col, icon_rend, "pixbuf", 0);
   gtk_tree_view_column_pack_start(col, text_rend, TRUE);
   gtk_tree_view_column_add_attribute(col, text_rend, "markup", 1);
   gtk_tree_view_append_column(tree, col);
-  g_signal_connect((GtkWidget*)tree, "row-activated", (GCallback)on_row_activated, win);
+  g_signal_connect((GtkWidget*)tree, "row-activated", (GCallback)on_row_activated, NULL);
   g_object_set_data((GObject*)tree, "quickpurple-buffer", buffer);
   gtk_container_add((GtkContainer*)scroll, (GtkWidget*)tree);
+  g_signal_connect((GObject*)gtk_scrolled_window_get_vadjustment(
+        (GtkScrolledWindow*)scroll),
+      "value-changed", (GCallback)on_results_scrolled, tree);
   gtk_container_set_border_width((GtkContainer*)vbox, 4);
   gtk_box_pack_start((GtkBox*)vbox, (GtkWidget*)entry, FALSE, FALSE, 0);
   gtk_box_pack_start((GtkBox*)vbox, scroll, TRUE, TRUE, 0);
   gtk_container_add((GtkContainer*)win, (GtkWidget*)vbox);
-  gtk_widget_show_all((GtkWidget*)win);
+  gtk_widget_show_all(vbox);
+  gtk_widget_realize((GtkWidget*)win);
+  quick_window = (GtkWidget*)win;
+}
 
-  messages = get_unread_messages();
-  populate_tree(tree, messages);
-  g_slist_free(messages);
+static void destroy_ui()
+{
+  gtk_widget_destroy(quick_window);
+  quick_window = NULL;
+}
+
+static void show_ui(guint32 time)
+{
+  GtkEntry* entry = (GtkEntry*)g_object_get_data((GObject*)quick_window, "quickpurple-entry");
+  GtkEntryBuffer* buffer = gtk_entry_get_buffer(entry);
+  GtkTreeView* tree = (GtkTreeView*)g_object_get_data((GObject*)buffer, "quickpurple-tree");
+  // timed only when the window is mapped again, one already shown may not
+  // be exposed at all
+  show_time = gtk_widget_get_visible(quick_window) ? 0 :
+    g_get_monotonic_time();
+  quick_index_hold_ids(item_index, TRUE);
+  gtk_entry_buffer_set_text(buffer, "", -1);
+  // an empty query shows the unread messages rather than searching
+  g_object_set_data((GObject*)buffer, "quickpurple-search", NULL);
+  populate_tree(tree, get_unread_messages(), FALSE, 0);
+  gtk_widget_grab_focus((GtkWidget*)entry);
+  gtk_window_present_with_time((GtkWindow*)quick_window, time);
 }
 
 // plugin related stuff
 
 static void plugin_action_test_cb(PurplePluginAction *action)
 {
-  GSequence* index = create_index();
-  create_ui(index);
+  show_ui(GDK_CURRENT_TIME);
 }
 
 static GList* plugin_actions(PurplePlugin* plugin, gpointer context)
@@ -699,14 +1952,11 @@ static GList* plugin_actions(PurplePlugin* plugin, gpointer context)
 
 //Hotkey handling
 
-#define PREF_ROOT "/plugins/gtk/quickpurple"
-#define HOTKEY_PREF PREF_ROOT "/hotkey"
-
 static GtkHotkeyInfo* gtk_hotkey_info = NULL;
 
 static void on_hotkey(GtkHotkeyInfo* info, guint event_time, gpointer user_data)
 {
-  plugin_action_test_cb(NULL);
+  show_ui(event_time);
 }
 
 static void unbind_hotkey()
@@ -741,12 +1991,25 @@ static gboolean quickpurple_load(PurplePlugin* plugin)
 {
   const char* hotkey = purple_prefs_get_string(HOTKEY_PREF);
   bind_hotkey(hotkey);
+  load_usage();
+  create_index();
+  create_icon_cache(plugin);
+  connect_index_signals(plugin);
+  create_unread_tracker(plugin);
+  create_message_index(plugin);
+  create_ui();
   return TRUE;
 }
 
 static gboolean quickpurple_unload(PurplePlugin* plugin)
 {
   unbind_hotkey();
+  destroy_ui();
+  destroy_unread_tracker();
+  destroy_message_index();
+  destroy_index();
+  destroy_usage();
+  destroy_icon_cache(plugin);
   return TRUE;
 }
 
@@ -772,6 +2035,7 @@ static GtkWidget* quickpurple_config_frame(PurplePlugin *plugin)
 {
   GtkWidget* frame = gtk_vbox_new(FALSE, 4);
   GtkWidget* vbox = pidgin_make_frame(frame, "Hotkey");
+  GtkWidget* search = pidgin_make_frame(frame, "Search");
   GtkWidget* entry = gtk_entry_new();
   GtkEntryBuffer* buffer = gtk_entry_get_buffer((GtkEntry*)entry);
   if (gtk_hotkey_info)
@@ -781,6 +2045,8 @@ static GtkWidget* quickpurple_config_frame(PurplePlugin *plugin)
   g_signal_connect(entry, "key-press-event",
       (GCallback)on_hotkey_pressed, NULL);
   gtk_container_add((GtkContainer*)vbox, entry);
+  pidgin_prefs_checkbox("Find text inside words, using more memory",
+      SUBSTRINGS_PREF, search);
   gtk_widget_show_all(frame);
   return frame;  
 }
@@ -832,6 +2098,7 @@ static void init_plugin(PurplePlugin *plugin)
 {
   purple_prefs_add_none(PREF_ROOT);
   purple_prefs_add_string(HOTKEY_PREF, "<Control><Alt>I");
+  purple_prefs_add_bool(SUBSTRINGS_PREF, FALSE);
 }
 
 PURPLE_INIT_PLUGIN(hello_purple, init_plugin, info)